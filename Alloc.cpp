@@ -0,0 +1,64 @@
+#include "Alloc.h"
+#include<cstdlib>
+#include<cstddef>
+#include<new>
+#include<fstream>
+#include<string>
+#include<sys/resource.h>
+
+AllocCounters alloc_counters={0, 0, 0, 0};
+
+#ifdef COUNT_ALLOCS
+// Each block keeps its size in front so that delete can take it off live
+static const size_t HEADER=alignof(max_align_t);
+void* operator new(size_t size)
+{
+	char* p=(char*)malloc(size+HEADER);
+	if(p==NULL)
+		throw std::bad_alloc();
+	*(size_t*)p=size;
+	alloc_counters.allocations++;
+	alloc_counters.bytes+=size;
+	alloc_counters.live+=size;
+	if(alloc_counters.live>alloc_counters.peak)
+		alloc_counters.peak=alloc_counters.live;
+	return p+HEADER;
+}
+void operator delete(void* p) noexcept
+{
+	if(p==NULL)
+		return;
+	char* block=(char*)p-HEADER;
+	alloc_counters.live-=*(size_t*)block;
+	free(block);
+}
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+#endif
+
+bool allocCounting()
+{
+#ifdef COUNT_ALLOCS
+	return true;
+#else
+	return false;
+#endif
+}
+void resetAllocPeak()
+{
+	alloc_counters.peak=alloc_counters.live;
+}
+// Linux reports VmHWM, which bench resets between phases through /proc/self/clear_refs
+long peakRSS()
+{
+	std::ifstream fin("/proc/self/status", std::ios::in);
+	std::string line;
+	while(getline(fin, line))
+		if(line.compare(0, 6, "VmHWM:")==0)
+			return stol(line.substr(6));
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
@@ -0,0 +1,23 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+/*
+	Heap usage of the process, counted by replacing the global operator
+	new and delete when built with -DCOUNT_ALLOCS (make alloc). The
+	counters stay zero in a normal build.
+*/
+struct AllocCounters
+{
+	long allocations;
+	long bytes;
+	// Bytes currently allocated and the most since the last resetAllocPeak
+	long live;
+	long peak;
+};
+extern AllocCounters alloc_counters;
+// True when the counting hooks are compiled in
+bool allocCounting();
+void resetAllocPeak();
+// Peak resident set size of the process in KB
+long peakRSS();
+#endif
@@ -0,0 +1,59 @@
+#include "Arena.h"
+#include<cstdlib>
+#include<cstdint>
+#include<new>
+
+ARENA::ARENA()
+{
+	chunk_size=FIRST_CHUNK;
+	next=NULL;
+	left=used=reserved=0;
+}
+ARENA::~ARENA()
+{
+	release();
+}
+void* ARENA::allocate(size_t bytes, size_t align)
+{
+	size_t skip=(align-(uintptr_t)next%align)%align;
+	if(next==NULL || skip+bytes>left)
+	{
+		// Requests larger than a chunk get a chunk of their own
+		size_t size=max(chunk_size, bytes+align);
+		char* chunk=(char*)malloc(size);
+		if(chunk==NULL)
+			throw bad_alloc();
+		chunks.push_back(chunk);
+		reserved+=size;
+		next=chunk;
+		left=size;
+		chunk_size=min(chunk_size*2, MAX_CHUNK);
+		skip=(align-(uintptr_t)next%align)%align;
+	}
+	void* p=next+skip;
+	next+=skip+bytes;
+	left-=skip+bytes;
+	used+=bytes;
+	return p;
+}
+void ARENA::release()
+{
+	for(char* chunk : chunks)
+		free(chunk);
+	chunks.clear();
+	chunk_size=FIRST_CHUNK;
+	next=NULL;
+	left=used=reserved=0;
+}
+size_t ARENA::bytesUsed()
+{
+	return used;
+}
+size_t ARENA::bytesReserved()
+{
+	return reserved;
+}
+int ARENA::chunkCount()
+{
+	return chunks.size();
+}
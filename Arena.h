@@ -0,0 +1,60 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include<vector>
+#include<cstddef>
+using namespace std;
+
+/*
+	Bump allocator for data that lives as long as one assembly. Memory
+	comes from chunks that double in size up to MAX_CHUNK, nothing is
+	freed on its own and every chunk is released at once by release() or
+	the destructor.
+*/
+class ARENA
+{
+	private:
+		vector<char*> chunks;
+		size_t chunk_size;
+		char* next;
+		size_t left;
+		size_t used;
+		size_t reserved;
+		static constexpr size_t FIRST_CHUNK=4096;
+		static constexpr size_t MAX_CHUNK=1<<20;
+
+	public:
+		ARENA();
+		~ARENA();
+		ARENA(const ARENA&)=delete;
+		ARENA& operator=(const ARENA&)=delete;
+		void* allocate(size_t bytes, size_t align);
+		void release();
+		size_t bytesUsed();
+		size_t bytesReserved();
+		int chunkCount();
+};
+
+// Standard allocator over an ARENA, deallocate does nothing as the arena frees everything at the end
+template<typename T> struct ArenaAllocator
+{
+	typedef T value_type;
+	ARENA* arena;
+	ArenaAllocator(ARENA* arena) : arena(arena) {}
+	template<typename U> ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+	T* allocate(size_t n)
+	{
+		return (T*)arena->allocate(n*sizeof(T), alignof(T));
+	}
+	void deallocate(T*, size_t) {}
+};
+template<typename T, typename U> bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+	return a.arena==b.arena;
+}
+template<typename T, typename U> bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+	return a.arena!=b.arena;
+}
+template<typename T> using ArenaVector=vector<T, ArenaAllocator<T>>;
+#endif
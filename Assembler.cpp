@@ -2,8 +2,134 @@
 // https://riscv.org/wp-content/uploads/2017/05/riscv-spec-v2.2.pdf
 // https://en.wikichip.org/wiki/risc-v/registers
 #include "Assembler.h"
+#include "RVC.h"
 
-Map* Map::instance=0;
+thread_local SymbolTable* REGISTERS::symbol_table=NULL;
+thread_local bool REGISTERS::byte_addressed=false;
+thread_local long REGISTERS::lookups=0;
+thread_local long OPERATIONS::lookups=0;
+STATS::STATS()
+{
+	enabled=counting=false;
+	lines=labels=data_bytes=0;
+	for(int i=0;i<5;i++)
+	{
+		seconds[i]=0;
+		allocations[i]=bytes[i]=peak_live[i]=0;
+		for(int j=0;j<5;j++)
+			counts[i][j]=0;
+	}
+}
+void STATS::setEnabled(bool enabled)
+{
+	this->enabled=enabled;
+}
+bool STATS::isEnabled()
+{
+	return enabled;
+}
+void STATS::setCounting(bool counting)
+{
+	this->counting=counting && COUNTERS::getInstance()->open()>0;
+}
+void STATS::start(Phase phase)
+{
+	if(!enabled)
+		return;
+	started[phase]=chrono::steady_clock::now();
+	allocations_at_start[phase]=alloc_counters.allocations;
+	bytes_at_start[phase]=alloc_counters.bytes;
+	// Reading and writing inside a pass are reported on their own
+	if(phase==PASS_ONE || phase==PASS_TWO)
+	{
+		io[phase]=seconds[READ]+seconds[WRITE];
+		io_allocations[phase]=allocations[READ]+allocations[WRITE];
+		io_bytes[phase]=bytes[READ]+bytes[WRITE];
+	}
+	// Read and write run inside the passes and share their peak, counters are too costly per line
+	if(phase!=READ && phase!=WRITE)
+	{
+		resetAllocPeak();
+		if(counting)
+			COUNTERS::getInstance()->read(counts_at_start[phase]);
+	}
+}
+void STATS::stop(Phase phase)
+{
+	if(!enabled)
+		return;
+	seconds[phase]+=chrono::duration<double>(chrono::steady_clock::now()-started[phase]).count();
+	allocations[phase]+=alloc_counters.allocations-allocations_at_start[phase];
+	bytes[phase]+=alloc_counters.bytes-bytes_at_start[phase];
+	if(phase==PASS_ONE || phase==PASS_TWO)
+	{
+		seconds[phase]-=seconds[READ]+seconds[WRITE]-io[phase];
+		allocations[phase]-=allocations[READ]+allocations[WRITE]-io_allocations[phase];
+		bytes[phase]-=bytes[READ]+bytes[WRITE]-io_bytes[phase];
+	}
+	if(phase!=READ && phase!=WRITE)
+	{
+		peak_live[phase]=max(peak_live[phase], alloc_counters.peak);
+		if(counting)
+		{
+			long long now[5];
+			COUNTERS::getInstance()->read(now);
+			for(int i=0;i<5;i++)
+				counts[phase][i]+=now[i]-counts_at_start[phase][i];
+		}
+	}
+}
+void STATS::print(long lookups)
+{
+	const char* names[5]={"read", "pass one", "symbol table", "pass two", "write"};
+	double total=0;
+	cout<<"\nSTATS\n";
+	for(int i=0;i<5;i++)
+	{
+		cout<<names[i]<<" : "<<seconds[i]*1000<<" ms";
+		if(allocCounting())
+		{
+			cout<<", "<<allocations[i]<<" allocations, "<<bytes[i]<<" bytes";
+			if(i!=READ && i!=WRITE)
+				cout<<", peak live heap "<<peak_live[i]<<" bytes";
+		}
+		cout<<endl;
+		total+=seconds[i];
+	}
+	cout<<"total : "<<total*1000<<" ms"<<endl;
+	if(allocCounting())
+		cout<<"allocations : "<<alloc_counters.allocations<<", "<<alloc_counters.bytes<<" bytes"<<endl;
+	cout<<"peak RSS : "<<peakRSS()<<" KB"<<endl;
+	if(counting)
+	{
+		COUNTERS* c=COUNTERS::getInstance();
+		for(int i=PASS_ONE;i<=PASS_TWO;i++)
+		{
+			cout<<names[i]<<" counters :";
+			for(int j=0;j<5;j++)
+			{
+				cout<<(j==0?" ":", ")<<COUNTERS::names[j]<<" ";
+				if(c->isAvailable((COUNTERS::Event)j))
+					cout<<counts[i][j];
+				else
+					cout<<"n/a";
+			}
+			if(c->isAvailable(COUNTERS::CYCLES) && c->isAvailable(COUNTERS::INSTRUCTIONS) && counts[i][COUNTERS::CYCLES]>0)
+				cout<<", IPC "<<(double)counts[i][COUNTERS::INSTRUCTIONS]/counts[i][COUNTERS::CYCLES];
+			cout<<endl;
+		}
+	}
+	long instructions=0;
+	for(pair<const unsigned char, long> &format : formats)
+		instructions+=format.second;
+	cout<<"lines read : "<<lines<<endl;
+	cout<<"instructions : "<<instructions<<endl;
+	for(pair<const unsigned char, long> &format : formats)
+		cout<<"  "<<format.first<<" : "<<format.second<<endl;
+	cout<<"labels : "<<labels<<endl;
+	cout<<"data bytes : "<<data_bytes<<endl;
+	cout<<"hash lookups : "<<lookups<<endl;
+}
 OPERATIONS::OPERATIONS()
 {
 	// Many R type operations i.e. add sub or and
@@ -22,6 +148,7 @@ OPERATIONS::OPERATIONS()
 		{"lw", 0b0000011},
 		{"lb", 0b0000011},
 		{"addi", 0b0010011},
+		{"xori", 0b0010011},
 		{"jalr", 0b1100111},
 
 		// S - Type
@@ -57,6 +184,7 @@ OPERATIONS::OPERATIONS()
 		{"lw", 0b010},
 		{"lb", 0b000},
 		{"addi", 0b000},
+		{"xori", 0b100},
 		{"jalr", 0b000},
 
 		// S -Type
@@ -87,6 +215,8 @@ OPERATIONS::OPERATIONS()
 		{"ecall", 0b1110011},
 	};
 
+	pseudo={"nop", "ret", "j", "jr", "call", "li", "la", "mv", "not", "neg", "beqz", "bnez"};
+
 	type={
 		// R - Type
 		{"add", 'R'},
@@ -101,6 +231,7 @@ OPERATIONS::OPERATIONS()
 		{"lw", 'I'},
 		{"lb", 'I'},
 		{"addi", 'I'},
+		{"xori", 'I'},
 		{"jalr", 'I'},
 
 		// S -Type
@@ -123,6 +254,17 @@ OPERATIONS::OPERATIONS()
 
 		{"ecall", 'N'},
 	};
+
+	// Every encoding is built up front, so setIns only reads tables shared between threads
+	for(pair<const string, unsigned char> &op : opcode)
+	{
+		int ins=op.second;
+		if(funct3.find(op.first)!=funct3.end())
+			ins|=funct3[op.first]<<12;
+		if(funct7.find(op.first)!=funct7.end())
+			ins|=funct7[op.first]<<25;
+		uid[op.first]=ins;
+	}
 }
 // TODO : Instructions
 /*
@@ -145,6 +287,10 @@ REGISTERS::REGISTERS()
 	regex_reg_imm={"(\\+|-)?(\\d)+\\([xast](\\d)+\\)", "(,0x[0-9a-f]+)|(,(\\+|-)?(\\d)+)"};
 	regex_labels="[a-zA-Z_][a-zA-Z_0-9]*";
 }
+void REGISTERS::setByteAddressed(bool byte_addressed)
+{
+	this->byte_addressed=byte_addressed;
+}
 Map::Map()
 {
 	registers=new REGISTERS();
@@ -152,8 +298,8 @@ Map::Map()
 }
 Map* Map::getInstance()
 {
-	if(instance==NULL)
-		instance=new Map();
+	// A local static is created once even when threads race to the first call
+	static Map* instance=new Map();
 	return instance;
 }
 REGISTERS* Map::getRegisters()
@@ -190,18 +336,20 @@ vector<int> REGISTERS::extractRegisters(string reg, unsigned char type)
 				regs.resize(i);
 				return regs;
 			}
+			if(temp_reg[0]!='x')
+				lookups++;
 			switch(temp_reg[0])
 			{
-				case 'a':reg_code+=regcode["a"];break;
+				case 'a':reg_code+=regcode.at("a");break;
 				case 's':if(reg_code<2)
-							reg_code+=regcode["s"];
+							reg_code+=regcode.at("s");
 						else
-							reg_code+=regcode["S"];
+							reg_code+=regcode.at("S");
 						break;
 				case 't':if(reg_code<3)
-							reg_code+=regcode["t"];
+							reg_code+=regcode.at("t");
 						else
-							reg_code+=regcode["T"];
+							reg_code+=regcode.at("T");
 						break;
 			}
 			regs[i++]=reg_code;
@@ -350,9 +498,10 @@ int REGISTERS::setRegCode(int &ins, string reg, unsigned char type, int linenumb
 			return 1;
 		}
 		// regs[0] is destination regs[1] is source
-		// regs[0] should not be x0 
+		// regs[0] should not be x0 except for jalr (jr / ret) and addi x0,x0,0 (nop)
 		// regs[2] has the immediate value
-		if(regs[0]==0)
+		bool nop=(ins&0x707f)==0x13 && regs[1]==0 && regs[2]==0;
+		if(regs[0]==0 && (ins&127)!=0b1100111 && !nop)
 		{
 			perror("Invalid Destination Register");
 			return 2;
@@ -403,7 +552,27 @@ int REGISTERS::setRegCode(int &ins, string reg, unsigned char type, int linenumb
 		ins=ins|(regs[1]<<20);
 
 		// imm should be modified to find offset value which is (imm - linenumber) * 4 i.e. (ST_Entry of label - current linenumber) * 4
-		int offset=(regs[2]-linenumber-1)<<2;
+		// In byte addressed mode linenumber is the address of this 4 byte instruction
+		int offset=byte_addressed?regs[2]-linenumber-4:(regs[2]-linenumber-1)<<2;
+		if(byte_addressed)
+		{
+			// Mixed with 16 bit forms, so packed as RISC-V does with imm[12:1] holding the byte offset
+			if(offset<-4096 || offset>4095 || (offset&1)!=0)
+			{
+				perror("Branch offset out of range");
+				return 3;
+			}
+			ins=ins|(((offset>>11)&1)<<7);
+			ins=ins|(((offset>>1)&15)<<8);
+			ins=ins|(((offset>>5)&63)<<25);
+			ins=ins|(((offset>>12)&1)<<31);
+			return 0;
+		}
+		if(offset<-2048 || offset>2047)
+		{
+			perror("Branch offset out of range");
+			return 3;
+		}
 		// offset
 		// offset is split into 4 segments
 		// bit 11 from LSB at index 7 of ins
@@ -442,19 +611,33 @@ int REGISTERS::setRegCode(int &ins, string reg, unsigned char type, int linenumb
 			perror("Invalid Syntax");
 			return 1;
 		}
-		// regs[0] is destination
+		// regs[0] is destination - x0 discards the link (j)
 		// regs[1] has the immediate value
-		if(regs[0]==0)
-		{
-			perror("Invalid Destination Register");
-			return 2;
-		}
 
 		// rd
 		ins=ins|(regs[0]<<7);
 		
 		// imm should be modified to find offset value which is (imm - linenumber) * 4 i.e. (ST_Entry of label - current linenumber) * 4
-		int offset=(regs[1]-linenumber-1)<<2;
+		int offset=byte_addressed?regs[1]-linenumber-4:(regs[1]-linenumber-1)<<2;
+		if(byte_addressed)
+		{
+			// imm[20|10:1|11|19:12] at bits 31, 30-21, 20 and 19-12
+			if(offset<-(1<<20) || offset>=(1<<20) || (offset&1)!=0)
+			{
+				perror("Jump offset out of range");
+				return 3;
+			}
+			ins=ins|(((offset>>20)&1)<<31);
+			ins=ins|(((offset>>1)&1023)<<21);
+			ins=ins|(((offset>>11)&1)<<20);
+			ins=ins|(((offset>>12)&255)<<12);
+			return 0;
+		}
+		if(offset<-(1<<19) || offset>=(1<<19))
+		{
+			perror("Jump offset out of range");
+			return 3;
+		}
 		// offset
 		// offset is split into 4 segments
 		// bit 20 from LSB at index 31 of ins
@@ -468,36 +651,159 @@ int REGISTERS::setRegCode(int &ins, string reg, unsigned char type, int linenumb
 	}
 	return 0;
 }
-void REGISTERS::setSymbolTable(unordered_map<string, ST_Entry> &symbol_table)
+void REGISTERS::setSymbolTable(SymbolTable &symbol_table)
 {
-	this->symbol_table=symbol_table;
+	this->symbol_table=&symbol_table;
+}
+void REGISTERS::releaseSymbolTable(SymbolTable &symbol_table)
+{
+	if(this->symbol_table==&symbol_table)
+		this->symbol_table=NULL;
 }
 int REGISTERS::getSymbolTableValue(string symbol)
 {
-	unordered_map<string, ST_Entry>::iterator pos;
-	if(symbol_table.find(symbol) == symbol_table.end())
+	lookups++;
+	if(symbol_table==NULL)
+		return -1;
+	SymbolTable::iterator pos=symbol_table->find(symbol);
+	if(pos==symbol_table->end())
 		return -1;
-	return symbol_table[symbol].value;
+	return pos->second.value;
 }
 unsigned char OPERATIONS::setIns(int &ins, string op)
 {
-	if(uid.find(op) != uid.end())
-	{
-		ins=ins|uid[op];
-		return type[op];
-	}
-	if(opcode.find(op) == opcode.end())
+	lookups+=2;
+	unordered_map<string, int>::iterator pos=uid.find(op);
+	if(pos==uid.end())
 	{
 		perror("Invalid Operation");
 		return '\0';
 	}
-	ins=ins|opcode[op];
-	if(funct3.find(op) != opcode.end())
-		ins=ins|(funct3[op]<<12);
-	if(funct7.find(op) != opcode.end())
-		ins=ins|(funct7[op]<<25);
-	uid[op]=ins;
-	return type[op];
+	ins=ins|pos->second;
+	return type.at(op);
+}
+void OPERATIONS::splitIns(string &line, string &op, string &reg_list)
+{
+	// The first two words, as iss>>op>>reg_list reads them
+	const char* space=" \t\r\n\v\f";
+	size_t start=line.find_first_not_of(space);
+	size_t end=line.find_first_of(space, start);
+	op=start==string::npos?"":line.substr(start, end-start);
+	start=line.find_first_not_of(space, end);
+	end=line.find_first_of(space, start);
+	reg_list=start==string::npos?"":line.substr(start, end-start);
+}
+unsigned char OPERATIONS::getType(string op)
+{
+	lookups+=2;
+	unordered_map<string, unsigned char>::iterator pos=type.find(op);
+	if(pos == type.end())
+		return '\0';
+	return pos->second;
+}
+void OPERATIONS::loadImmediate(string rd, int value, vector<string> &expanded)
+{
+	// Shortest sequence - addi alone for 12 bit values, lui (+ addi for the low bits) otherwise
+	if(value>=-2048 && value<2048)
+	{
+		expanded.push_back("addi "+rd+",x0,"+to_string(value));
+		return;
+	}
+	// addi sign extends its immediate so the upper part absorbs the borrow
+	int lo=((value&4095)^2048)-2048;
+	unsigned int hi=((unsigned int)value-(unsigned int)lo)>>12;
+	expanded.push_back("lui "+rd+","+to_string(hi&1048575));
+	if(lo!=0)
+		expanded.push_back("addi "+rd+","+rd+","+to_string(lo));
+}
+int OPERATIONS::expandPseudo(string ins_tac, vector<string> &expanded)
+{
+	expanded.clear();
+	// Most lines are real instructions, only the mnemonic is needed to pass them through
+	size_t first=ins_tac.find_first_not_of(" \t\r\n\v\f");
+	if(first==string::npos || pseudo.find(ins_tac.substr(first, ins_tac.find_first_of(" \t\r\n\v\f", first)-first))==pseudo.end())
+	{
+		expanded.push_back(ins_tac);
+		return 0;
+	}
+	istringstream iss(ins_tac);
+	string op, reg_list;
+	iss>>op>>reg_list;
+
+	vector<string> args;
+	stringstream ss(reg_list);
+	string arg;
+	while(getline(ss, arg, ','))
+		args.push_back(arg);
+
+	try
+	{
+		if(op=="nop" || op=="ret")
+		{
+			expanded.push_back(op=="nop"?"addi x0,x0,0":"jalr x0,0(x1)");
+			return 0;
+		}
+		if(op=="j" || op=="jr" || op=="call")
+		{
+			if(args.size()!=1)
+			{
+				perror("Invalid Syntax");
+				return 1;
+			}
+			if(op=="j")
+				expanded.push_back("jal x0,"+args[0]);
+			else if(op=="jr")
+				expanded.push_back("jalr x0,0("+args[0]+")");
+			else
+				expanded.push_back("jal x1,"+args[0]);
+			return 0;
+		}
+		if(op=="li" || op=="la" || op=="mv" || op=="not" || op=="neg" || op=="beqz" || op=="bnez")
+		{
+			if(args.size()!=2)
+			{
+				perror("Invalid Syntax");
+				return 1;
+			}
+			if(op=="li")
+			{
+				// Any 32 bit pattern, so 0xFFFFFFFF loads -1
+				long long value=stoll(args[1], 0, 0);
+				if(value<INT_MIN || value>UINT_MAX)
+					throw out_of_range("li");
+				loadImmediate(args[0], (int)(unsigned int)value, expanded);
+			}
+			else if(op=="la")
+			{
+				// Variables are placed before the text section is read so the address is known
+				int value=Map::getInstance()->getRegisters()->getSymbolTableValue(args[1]);
+				if(value==-1)
+				{
+					perror("Invalid Label not found");
+					return 2;
+				}
+				loadImmediate(args[0], value, expanded);
+			}
+			else if(op=="mv")
+				expanded.push_back("addi "+args[0]+","+args[1]+",0");
+			else if(op=="not")
+				expanded.push_back("xori "+args[0]+","+args[1]+",-1");
+			else if(op=="neg")
+				expanded.push_back("sub "+args[0]+",x0,"+args[1]);
+			else if(op=="beqz")
+				expanded.push_back("beq "+args[0]+",x0,"+args[1]);
+			else
+				expanded.push_back("bne "+args[0]+",x0,"+args[1]);
+			return 0;
+		}
+	}
+	catch(const exception& e)
+	{
+		perror("Invalid Syntax");
+		return 3;
+	}
+	expanded.push_back(ins_tac);
+	return 0;
 }
 ST_Entry::ST_Entry(){}
 ST_Entry::ST_Entry(int type, int value)
@@ -515,6 +821,8 @@ void ST_Entry::ST_Print()
 	cout<<"Value : "<<value<<endl;
 }
 Assembler::Assembler()
+	: symbol_table(0, hash<string>(), equal_to<string>(), &arena), branches(&arena), relaxed(&arena),
+	sizes(&arena), aligns(0, hash<int>(), equal_to<int>(), &arena), padding(0, hash<int>(), equal_to<int>(), &arena)
 {
 	// base address where all variables are stored - set by processor team
 	baseAddress=1024;
@@ -529,14 +837,83 @@ Assembler::Assembler()
 		{'n','\n'},
 		{'t', '\t'}
 	};
+	inverse={
+		{"beq", "bne"}, {"bne", "beq"},
+		{"blt", "bge"}, {"bge", "blt"},
+		{"bltu", "bgeu"}, {"bgeu", "bltu"},
+	};
+	compress=false;
+	loop_align=0;
+	instructions=0;
+	streaming=false;
+	lookups_before=0;
 	regex_labels="^[a-zA-Z_][a-zA-Z_0-9]*";
+	label_regexp=regex(regex_labels);
 	regex_comment="^# (.)*";
 	regex_asciz="\"(.)*\"";
 }
+Assembler::~Assembler()
+{
+	Map::getInstance()->getRegisters()->releaseSymbolTable(symbol_table);
+}
+void Assembler::setCompressed(bool compress)
+{
+	this->compress=compress;
+}
+void Assembler::setLoopAlign(int loop_align)
+{
+	this->loop_align=loop_align;
+}
+void Assembler::setStreaming(bool streaming)
+{
+	this->streaming=streaming;
+}
+void Assembler::setStats(bool enabled)
+{
+	stats.setEnabled(enabled);
+}
+void Assembler::setCounters(bool enabled)
+{
+	stats.setCounting(enabled);
+}
+void Assembler::printStats()
+{
+	Map* m=Map::getInstance();
+	stats.print(m->getOperations()->lookups+m->getRegisters()->lookups-lookups_before);
+	cout<<"arena : "<<arena.bytesUsed()<<" bytes used, "<<arena.bytesReserved()<<" bytes in "<<arena.chunkCount()<<" chunks"<<endl;
+}
+void Assembler::bindEncoder()
+{
+	// REGISTERS is shared, but what it keeps for an assembly is per thread
+	REGISTERS* registers=Map::getInstance()->getRegisters();
+	registers->setByteAddressed(compress);
+	registers->setSymbolTable(symbol_table);
+}
+bool Assembler::readLine(ifstream &fin, string &line)
+{
+	stats.start(STATS::READ);
+	bool read=(bool)getline(fin, line);
+	stats.stop(STATS::READ);
+	stats.lines+=read;
+	return read;
+}
+void Assembler::writeLine(ofstream &fout, string line)
+{
+	stats.start(STATS::WRITE);
+	// The stream is flushed once when it is closed, not per line
+	fout<<line<<'\n';
+	stats.stop(STATS::WRITE);
+}
 int Assembler::terminate(int code)
 {
 	runningAddress=baseAddress;
 	symbol_table.clear();
+	branches.clear();
+	relaxed.clear();
+	sizes.clear();
+	aligns.clear();
+	padding.clear();
+	instructions=0;
 	return code;
 }
 string Assembler::extractLabel(string vm_line, bool sectionType=true)
@@ -553,8 +930,7 @@ string Assembler::extractLabel(string vm_line, bool sectionType=true)
 	string label="";
 	try
 	{
-		regex regexp(regex_labels);
-		sregex_iterator next(vm_line.begin(), vm_line.end(), regexp);
+		sregex_iterator next(vm_line.begin(), vm_line.end(), label_regexp);
 		sregex_iterator end;
 
 		if(next==end)
@@ -579,6 +955,9 @@ string Assembler::extractLabel(string vm_line, bool sectionType=true)
 }
 string Assembler::extractComment(string vm_line)
 {
+	// regex_comment is anchored at "# ", other lines never need the regex built
+	if(vm_line.compare(0, 2, "# ")!=0)
+		return "";
 	string comment="";
 	try
 	{
@@ -693,6 +1072,24 @@ void Assembler::printST()
 		cout<<"______________________________________\n";
 	}
 }
+int Assembler::alignOf(string vm_line)
+{
+	// .align n and .p2align n both align to 2^n bytes, 0 for other lines and -1 when invalid
+	size_t first=vm_line.find_first_not_of(" \t\r\n\v\f");
+	if(first==string::npos || vm_line[first]!='.')
+		return 0;
+	istringstream iss(vm_line);
+	string directive;
+	int n;
+	if(!(iss>>directive) || (directive!=".align" && directive!=".p2align"))
+		return 0;
+	if(!(iss>>n) || n<0 || n>12)
+	{
+		perror("Invalid Syntax for Alignment");
+		return -1;
+	}
+	return 1<<n;
+}
 int Assembler::firstPass(string vmout)
 {
 	ifstream fin(vmout, ios::in);
@@ -702,14 +1099,20 @@ int Assembler::firstPass(string vmout)
 		return terminate(1);
 	}
 	
+	TR_Scope trace("first_pass", vmout);
 	string vm_line="";
 	int countText=0, countData=0;
+	Map* m=Map::getInstance();
+	lookups_before=m->getOperations()->lookups+m->getRegisters()->lookups;
+	// Data symbols are needed to size la
+	bindEncoder();
+	stats.start(STATS::PASS_ONE);
 	
-	while(vm_line==".section" || getline(fin, vm_line))
+	while(vm_line==".section" || readLine(fin, vm_line))
 	{
 		if(vm_line==".section")
 		{
-			getline(fin, vm_line);
+			readLine(fin, vm_line);
 			if(vm_line==".data")
 			{
 				countData++;
@@ -719,7 +1122,7 @@ int Assembler::firstPass(string vmout)
 					return terminate(2);
 				}
 
-				while(getline(fin, vm_line))
+				while(readLine(fin, vm_line))
 				{
 					if(vm_line.length()==0)
 						continue;
@@ -728,7 +1131,7 @@ int Assembler::firstPass(string vmout)
 					string label=extractLabel(vm_line);
 					if(label=="")
 						return terminate(3);
-					getline(fin, vm_line);
+					readLine(fin, vm_line);
 					int code=extractTypeAndValue(label, vm_line);
 					if(code!=0)
 						return terminate(4);
@@ -744,23 +1147,52 @@ int Assembler::firstPass(string vmout)
 				}
 
 				int linenumber=0;
-				while(getline(fin, vm_line))
+				vector<string> expanded;
+				while(readLine(fin, vm_line))
 				{
 					if(vm_line.length()==0)
 						continue;
 					
+					int align=alignOf(vm_line);
+					if(align<0)
+						return terminate(10);
+					if(align>0)
+					{
+						aligns[linenumber]=max(aligns[linenumber], align);
+						continue;
+					}
+
 					string label=extractLabel(vm_line, false);
 					if(label=="")
 					{
 						string comment=extractComment(vm_line);
 						if(comment=="")
-							linenumber++;
+						{
+							// Pseudo-instructions may take more than one line
+							if(Map::getInstance()->getOperations()->expandPseudo(vm_line, expanded)!=0)
+								return terminate(8);
+							for(string &line : expanded)
+							{
+								string op, reg_list;
+								Map::getInstance()->getOperations()->splitIns(line, op, reg_list);
+								unsigned char type=Map::getInstance()->getOperations()->getType(op);
+								string target=reg_list.substr(reg_list.rfind(',')+1);
+								if(type=='B' && !streaming)
+									branches.push_back(make_pair(linenumber, target));
+								// A branch or j to a label already seen closes a loop
+								bool jump=type=='B' || (op=="jal" && (reg_list.compare(0, 3, "x0,")==0 || reg_list.compare(0, 5, "zero,")==0));
+								if(loop_align>0 && jump && symbol_table.find(target)!=symbol_table.end() && symbol_table[target].type==0)
+									aligns[symbol_table[target].value]=max(aligns[symbol_table[target].value], loop_align);
+								linenumber++;
+							}
+						}
 						continue;
 					}
 
 					ST_Entry S(0, linenumber);
 					symbol_table[label]=S;
 				}
+				instructions=linenumber;
 			}
 			else
 			{
@@ -775,161 +1207,497 @@ int Assembler::firstPass(string vmout)
 		return terminate(7);
 	}
 
+	stats.stop(STATS::PASS_ONE);
+	// Same phases as --stats, the symbol table is not part of pass one
+	trace.end();
+
+	stats.start(STATS::SYMBOLS);
+	traceBegin("symbol_table", vmout);
+	if(relaxBranches(vmout)<0)
+	{
+		traceEnd("symbol_table", vmout);
+		return terminate(11);
+	}
+	if(compress && layoutCompressed(vmout)!=0)
+	{
+		traceEnd("symbol_table", vmout);
+		return terminate(9);
+	}
+	if(!compress)
+		alignLines();
 	Map::getInstance()->getRegisters()->setSymbolTable(symbol_table);
+	traceEnd("symbol_table", vmout);
+	stats.stop(STATS::SYMBOLS);
+	for(pair<const string, ST_Entry> &entry : symbol_table)
+		if(entry.second.type==0)
+			stats.labels++;
+	stats.data_bytes=runningAddress-baseAddress;
 	return 0;
 }
-int Assembler::secondPass(string vmout, string asmout)
+int Assembler::shiftOf(int linenumber)
+{
+	// Each relaxed branch before linenumber adds one jal
+	return lower_bound(relaxed.begin(), relaxed.end(), linenumber)-relaxed.begin();
+}
+int Assembler::relaxBranches(string vmout)
+{
+	/*
+		B offsets are (label - linenumber - 1) * 4 and must fit the
+		signed 12 bit immediate. An out of range branch becomes
+			bXX rs1,rs2,L     ->   bYY rs1,rs2,__relax__<n>
+			                       jal x0,L
+		which moves every later label, so repeat until nothing new is relaxed.
+	*/
+	relaxed.clear();
+	vector<pair<int, int>> stops;
+	bool changed=true;
+	while(changed)
+	{
+		changed=false;
+		vector<int> added;
+		// Alignment padding counts towards the distance
+		placeLines(stops);
+		auto check=[&](int linenumber, string &label)
+		{
+			if(binary_search(relaxed.begin(), relaxed.end(), linenumber))
+				return;
+			if(symbol_table.find(label)==symbol_table.end())
+				return;
+			int target=symbol_table[label].value;
+			if(target<0 || target>instructions)
+				return;
+			int offset=(lineOf(stops, target)-lineOf(stops, linenumber)-1)<<2;
+			if(offset<-2048 || offset>2047)
+				added.push_back(linenumber);
+		};
+		if(streaming)
+		{
+			if(scanBranches(vmout, check)!=0)
+				return -1;
+		}
+		else
+			for(pair<int, string> &branch : branches)
+				check(branch.first, branch.second);
+		if(!added.empty())
+		{
+			relaxed.insert(relaxed.end(), added.begin(), added.end());
+			sort(relaxed.begin(), relaxed.end());
+			changed=true;
+		}
+	}
+
+	for(pair<const string, ST_Entry> &entry : symbol_table)
+		if(entry.second.type==0)
+			entry.second.value+=shiftOf(entry.second.value);
+	// Target of the inverted branch is the instruction after the jal
+	for(int linenumber : relaxed)
+		symbol_table["__relax__"+to_string(linenumber)]=ST_Entry(0, linenumber+shiftOf(linenumber)+2);
+	ArenaIntMap emitted(0, hash<int>(), equal_to<int>(), &arena);
+	for(pair<const int, int> &align : aligns)
+		emitted[align.first+shiftOf(align.first)]=align.second;
+	aligns.swap(emitted);
+	return relaxed.size();
+}
+int Assembler::scanBranches(string vmout, function<void(int, string&)> visit)
 {
 	ifstream fin(vmout, ios::in);
 	if(!fin)
 	{
 		perror("VM output file does not exist");
-		return terminate(1);
+		return 1;
 	}
-	ofstream fout(asmout, ios::out);
-    
-	string ins_tac;
-	string op, reg_list;
-	int ins=0;
-	unsigned char type='\0';
-	int linenumber=0;
+	string vm_line;
+	while(readLine(fin, vm_line) && vm_line!=".text");
 
-	// Run through till .section .text
-	while(getline(fin, ins_tac))
+	// Same line numbering as the first pass
+	int linenumber=0;
+	vector<string> expanded;
+	while(readLine(fin, vm_line))
 	{
-		if(ins_tac==".section")
+		if(vm_line.length()==0 || alignOf(vm_line)!=0 || extractLabel(vm_line, false)!="" || extractComment(vm_line)!="")
+			continue;
+		if(Map::getInstance()->getOperations()->expandPseudo(vm_line, expanded)!=0)
+			return 2;
+		for(string &line : expanded)
 		{
-			getline(fin, ins_tac);
-			if(ins_tac==".data")
-				continue;
-			else if(ins_tac==".text")
-				break;
-			else
+			string op, reg_list;
+			Map::getInstance()->getOperations()->splitIns(line, op, reg_list);
+			if(Map::getInstance()->getOperations()->getType(op)=='B')
 			{
-				perror("Invalid Syntax");
-				return terminate(2);
+				string target=reg_list.substr(reg_list.rfind(',')+1);
+				visit(linenumber, target);
 			}
+			linenumber++;
+		}
+	}
+	return 0;
+}
+void Assembler::placeLines(vector<pair<int, int>> &stops)
+{
+	vector<int> at;
+	for(pair<const int, int> &align : aligns)
+		if(align.second>4 && align.first>=0 && align.first<=instructions)
+			at.push_back(align.first);
+	sort(at.begin(), at.end());
+	stops.clear();
+	int padded=0;
+	for(int i : at)
+	{
+		int k=aligns[i]/4;
+		int next=i+shiftOf(i)+padded;
+		padded+=(k-next%k)%k;
+		stops.push_back(make_pair(i, padded));
+	}
+}
+int Assembler::lineOf(vector<pair<int, int>> &stops, int linenumber)
+{
+	auto it=upper_bound(stops.begin(), stops.end(), make_pair(linenumber, INT_MAX));
+	return linenumber+shiftOf(linenumber)+(it==stops.begin()?0:prev(it)->second);
+}
+void Assembler::alignLines()
+{
+	int n=instructions+relaxed.size();
+	vector<int> at;
+	for(pair<const int, int> &align : aligns)
+		if(align.second>4 && align.first>=0 && align.first<=n)
+			at.push_back(align.first);
+	sort(at.begin(), at.end());
+	padding.clear();
+	vector<pair<int, int>> stops;
+	int padded=0;
+	for(int i : at)
+	{
+		int k=aligns[i]/4;
+		int pad=(k-(i+padded)%k)%k;
+		if(pad>0)
+			padding[i]=pad*4;
+		padded+=pad;
+		stops.push_back(make_pair(i, padded));
+	}
+	// Labels point past the padding so that it is only executed when falling through
+	for(pair<const string, ST_Entry> &entry : symbol_table)
+		if(entry.second.type==0 && entry.second.value>=0 && entry.second.value<=n)
+		{
+			auto it=upper_bound(stops.begin(), stops.end(), make_pair(entry.second.value, INT_MAX));
+			entry.second.value+=it==stops.begin()?0:prev(it)->second;
+		}
+}
+int Assembler::realInstructions(string ins_tac, int &index, vector<string> &lines)
+{
+	// Expands pseudo-instructions, then relaxed branches into inverted branch + jal x0
+	vector<string> expanded;
+	lines.clear();
+	if(Map::getInstance()->getOperations()->expandPseudo(ins_tac, expanded)!=0)
+		return 1;
+	for(string &line : expanded)
+	{
+		if(binary_search(relaxed.begin(), relaxed.end(), index))
+		{
+			istringstream iss(line);
+			string op, reg_list;
+			iss>>op>>reg_list;
+			size_t comma=reg_list.rfind(',');
+			lines.push_back(inverse[op]+" "+reg_list.substr(0, comma)+",__relax__"+to_string(index));
+			lines.push_back("jal x0,"+reg_list.substr(comma+1));
 		}
+		else
+			lines.push_back(line);
+		index++;
 	}
+	return 0;
+}
+int Assembler::layoutCompressed(string vmout)
+{
+	ifstream fin(vmout, ios::in);
+	if(!fin)
+	{
+		perror("VM output file does not exist");
+		return 1;
+	}
+
+	string ins_tac;
+	while(getline(fin, ins_tac) && ins_tac!=".text");
 
+	// Instructions in emission order, label values index into it
+	vector<IR_Ins> ins;
+	vector<string> lines;
+	IR_Ins ir;
+	int index=0;
 	while(getline(fin, ins_tac))
 	{
-		if(ins_tac.length()==0)
-			continue;
-		
-		if(extractLabel(ins_tac, false)!="")
+		if(ins_tac.length()==0 || extractLabel(ins_tac, false)!="" || extractComment(ins_tac)!="" || alignOf(ins_tac)!=0)
 			continue;
+		if(realInstructions(ins_tac, index, lines)!=0)
+			return 2;
+		for(string &line : lines)
+		{
+			if(parseLine(ir, line)!=0)
+				return 3;
+			ins.push_back(ir);
+		}
+	}
+	fin.close();
 
-		if(extractComment(ins_tac)!="")
-			continue;
+	/*
+		Everything but B and J is sized once. Branches and jumps start
+		at 4 bytes and shrink while their offset fits the 16 bit form.
+		Shrinking only brings instructions closer so this terminates.
+	*/
+	RVC rvc;
+	int n=ins.size();
+	sizes.assign(n, 4);
+	for(int i=0;i<n;i++)
+		if(ins[i].type!='B' && ins[i].type!='J' && rvc.compressible(ins[i], 0))
+			sizes[i]=2;
 
-		// Some ins have info hardcoded in uid (independent of registers, immediate etc)
-		// If more such ins should be added (We can add in a set and check)
-		ins=0;
-		if(ins_tac=="ecall")
+	/*
+		Alignment padding can grow when earlier code shrinks, so a branch
+		that was shrunk is checked again and pinned to 4 bytes if it no
+		longer fits. Pinned instructions never shrink again.
+	*/
+	vector<int> address(n+1, 0);
+	vector<bool> pinned(n, false);
+	bool changed=true;
+	while(changed)
+	{
+		changed=false;
+		placeAddresses(address);
+		for(int i=0;i<n;i++)
 		{
-			// OP
-			try
-			{
-				type=Map::getInstance()->getOperations()->setIns(ins, ins_tac);
-			}
-			catch(const exception& e)
+			if(pinned[i] || (ins[i].type!='B' && ins[i].type!='J'))
+				continue;
+			if(symbol_table.find(ins[i].label)==symbol_table.end())
+				continue;
+			int target=symbol_table[ins[i].label].value;
+			if(target<0 || target>n)
+				continue;
+			bool fits=rvc.compressible(ins[i], address[target]-address[i]-2);
+			if(sizes[i]==4 && fits)
 			{
-				perror("Invalid Operation");
-				return terminate(3);
+				sizes[i]=2;
+				changed=true;
 			}
-			if(type=='\0')
+			else if(sizes[i]==2 && !fits)
 			{
-				perror("Invalid Operation");
-				return terminate(4);
+				sizes[i]=4;
+				pinned[i]=true;
+				changed=true;
 			}
-			bitset<32> binary(ins);
-			fout<<binary<<endl;
-			linenumber++;
-			continue;
 		}
-		if(ins_tac=="nop")
+	}
+	placeAddresses(address);
+
+	for(pair<const string, ST_Entry> &entry : symbol_table)
+		if(entry.second.type==0 && entry.second.value>=0 && entry.second.value<=n)
+			entry.second.value=address[entry.second.value];
+	return 0;
+}
+void Assembler::placeAddresses(vector<int> &address)
+{
+	int n=sizes.size();
+	address.assign(n+1, 0);
+	padding.clear();
+	for(int i=0;i<=n;i++)
+	{
+		if(i>0)
+			address[i]=address[i-1]+sizes[i-1];
+		auto it=aligns.find(i);
+		if(it!=aligns.end() && it->second>2)
 		{
-			bitset<32> binary(ins);
-			fout<<binary<<endl;
-			linenumber++;
-			continue;
+			int pad=(it->second-address[i]%it->second)%it->second;
+			if(pad>0)
+				padding[i]=pad;
+			address[i]+=pad;
 		}
-
-		istringstream iss(ins_tac);
-
-		if(!(iss>>op>>reg_list))
+	}
+}
+int Assembler::encodeCompressed(string ins_tac, int address, ofstream &fout)
+{
+	IR_Ins ir;
+	if(parseLine(ir, ins_tac)!=0)
+		return 5;
+	int offset=0;
+	if(ir.type=='B' || ir.type=='J')
+	{
+		int target=Map::getInstance()->getRegisters()->getSymbolTableValue(ir.label);
+		if(target==-1)
 		{
-			perror("Invalid Syntax");
-			return terminate(2);
+			perror("Invalid Label not found");
+			return 5;
 		}
-		
+		offset=target-address-2;
+	}
+	RVC rvc;
+	bitset<16> binary(rvc.encode(ir, offset));
+	stats.formats['C']++;
+	writeLine(fout, binary.to_string());
+	return 0;
+}
+int Assembler::encodeIns(string ins_tac, int linenumber, ofstream &fout)
+{
+	string op, reg_list;
+	int ins=0;
+	unsigned char type='\0';
+
+	// Some ins have info hardcoded in uid (independent of registers, immediate etc)
+	// If more such ins should be added (We can add in a set and check)
+	if(ins_tac=="ecall")
+	{
 		// OP
 		try
 		{
-			type=Map::getInstance()->getOperations()->setIns(ins, op);
+			type=Map::getInstance()->getOperations()->setIns(ins, ins_tac);
 		}
 		catch(const exception& e)
 		{
 			perror("Invalid Operation");
-			return terminate(3);
+			return 3;
 		}
 		if(type=='\0')
 		{
-			cout<<op<<endl;
-			return terminate(4);
-		}
-		
-		// REG_LIST
-		try
-		{
-			if(Map::getInstance()->getRegisters()->setRegCode(ins, reg_list, type, linenumber)!=0)
-			{
-				perror("Invalid Syntax");
-				return terminate(5);
-			}
-			bitset<32> binary(ins);
-			fout<<binary<<endl;
-			linenumber++;
+			perror("Invalid Operation");
+			return 4;
 		}
-		catch(const exception& e)
+		bitset<32> binary(ins);
+		stats.formats['N']++;
+		writeLine(fout, binary.to_string());
+		return 0;
+	}
+
+	istringstream iss(ins_tac);
+
+	if(!(iss>>op>>reg_list))
+	{
+		perror("Invalid Syntax");
+		return 2;
+	}
+	
+	// OP
+	try
+	{
+		type=Map::getInstance()->getOperations()->setIns(ins, op);
+	}
+	catch(const exception& e)
+	{
+		perror("Invalid Operation");
+		return 3;
+	}
+	if(type=='\0')
+	{
+		cout<<op<<endl;
+		return 4;
+	}
+	
+	// REG_LIST
+	try
+	{
+		if(Map::getInstance()->getRegisters()->setRegCode(ins, reg_list, type, linenumber)!=0)
 		{
 			perror("Invalid Syntax");
-			return terminate(6);
+			return 5;
 		}
-		op.clear();
-		reg_list.clear();
-		type='\0';
+		bitset<32> binary(ins);
+		stats.formats[type]++;
+		writeLine(fout, binary.to_string());
 	}
-    fin.close();
-	fout.close();
-    return 0;
+	catch(const exception& e)
+	{
+		perror("Invalid Syntax");
+		return 6;
+	}
+	return 0;
 }
-
-int main()
+int Assembler::secondPass(string vmout, string asmout)
 {
-	string vmout="vmout.asm";
-	string asmout="asmout.o";
-
-	cout<<"------STARTED\n";
-
-	Assembler A;
-	int flag=A.firstPass(vmout);
-	if(flag==0)
+	// Input and output buffers are fixed size windows, so memory does not grow with the file
+	ifstream fin;
+	ofstream fout;
+	if(streaming)
+	{
+		fin.rdbuf()->pubsetbuf((char*)arena.allocate(STREAM_WINDOW, 1), STREAM_WINDOW);
+		fout.rdbuf()->pubsetbuf((char*)arena.allocate(STREAM_WINDOW, 1), STREAM_WINDOW);
+	}
+	fin.open(vmout, ios::in);
+	if(!fin)
 	{
-		A.printST();
-		cout<<"\nFIRST PASS COMPLETE\n\nSECOND PASS STARTED...\n";
-		flag=A.secondPass(vmout, asmout);
+		perror("VM output file does not exist");
+		return terminate(1);
 	}
+	fout.open(asmout, ios::out);
+	TR_Scope trace("second_pass", vmout);
+	bindEncoder();
+	stats.start(STATS::PASS_TWO);
+    
+	string ins_tac;
+	// linenumber counts emitted instructions, index counts them before relaxation
+	int linenumber=0, index=0, address=0;
+	vector<string> lines;
 
-	if(flag==0)
-		cout<<"\nSECOND PASS COMPLETE\n";
-	else
+	// Run through till .section .text
+	while(readLine(fin, ins_tac))
 	{
-		cout<<flag<<endl;
-		perror("Invalid Code");
-		return 1;
+		if(ins_tac==".section")
+		{
+			readLine(fin, ins_tac);
+			if(ins_tac==".data")
+				continue;
+			else if(ins_tac==".text")
+				break;
+			else
+			{
+				perror("Invalid Syntax");
+				return terminate(2);
+			}
+		}
 	}
 
-	cout<<"\nENDED------\n";
-}
\ No newline at end of file
+	while(readLine(fin, ins_tac))
+	{
+		if(ins_tac.length()==0)
+			continue;
+		
+		if(extractLabel(ins_tac, false)!="")
+			continue;
+
+		if(extractComment(ins_tac)!="" || alignOf(ins_tac)!=0)
+			continue;
+
+		if(realInstructions(ins_tac, index, lines)!=0)
+			return terminate(7);
+		for(string &line : lines)
+		{
+			// Alignment padding is addi x0,x0,0, c.nop in the 16 bit form
+			auto padded=padding.find(linenumber);
+			int bytes=padded==padding.end()?0:padded->second;
+			for(int pad=0;pad<bytes;pad+=compress?2:4)
+			{
+				if(compress)
+				{
+					writeLine(fout, bitset<16>(0x0001).to_string());
+					stats.formats['C']++;
+				}
+				else
+				{
+					writeLine(fout, bitset<32>(0x00000013).to_string());
+					stats.formats['I']++;
+				}
+				address+=compress?2:4;
+			}
+			int code;
+			if(compress && sizes[linenumber]==2)
+				code=encodeCompressed(line, address, fout);
+			else
+				code=encodeIns(line, compress?address:address/4, fout);
+			if(code!=0)
+				return terminate(code);
+			address+=compress?sizes[linenumber]:4;
+			linenumber++;
+		}
+	}
+    fin.close();
+	stats.start(STATS::WRITE);
+	fout.close();
+	stats.stop(STATS::WRITE);
+	stats.stop(STATS::PASS_TWO);
+    return 0;
+}
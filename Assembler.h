@@ -2,12 +2,24 @@
 #define ASSEMBLER_H
 
 #include<unordered_map>
+#include<unordered_set>
 #include<cstring>
 #include<regex>
 #include<iostream>
 #include<fstream>
 #include<bitset>
 #include<fcntl.h>
+#include<vector>
+#include<sstream>
+#include<algorithm>
+#include<chrono>
+#include<map>
+#include<functional>
+#include<climits>
+#include "Alloc.h"
+#include "Trace.h"
+#include "Counters.h"
+#include "Arena.h"
 using namespace std;
 struct ST_Entry
 {
@@ -22,6 +34,46 @@ struct ST_Entry
 	ST_Entry(int type, int value);
 	void ST_Print();
 };
+// Symbol table and per-line layout of one assembly are allocated from its arena
+typedef unordered_map<string, ST_Entry, hash<string>, equal_to<string>, ArenaAllocator<pair<const string, ST_Entry>>> SymbolTable;
+typedef unordered_map<int, int, hash<int>, equal_to<int>, ArenaAllocator<pair<const int, int>>> ArenaIntMap;
+// Phase times and counters printed by --stats, timers do nothing unless enabled
+class STATS
+{
+	private:
+		bool enabled;
+		chrono::steady_clock::time_point started[5];
+		// Read and write time and allocations already counted when a pass started
+		double io[5];
+		long io_allocations[5];
+		long io_bytes[5];
+		long allocations_at_start[5];
+		long bytes_at_start[5];
+		bool counting;
+		long long counts_at_start[5][5];
+
+	public:
+		enum Phase {READ, PASS_ONE, SYMBOLS, PASS_TWO, WRITE};
+		double seconds[5];
+		// Heap allocations, bytes allocated and peak live bytes (-DCOUNT_ALLOCS only)
+		long allocations[5];
+		long bytes[5];
+		long peak_live[5];
+		// Hardware counters of pass one, the symbol table and pass two, reading and writing included
+		long long counts[5][5];
+		long lines;
+		long labels;
+		long data_bytes;
+		// Emitted instructions by format, C for 16 bit forms
+		map<unsigned char, long> formats;
+		STATS();
+		void setEnabled(bool enabled);
+		bool isEnabled();
+		void setCounting(bool counting);
+		void start(Phase phase);
+		void stop(Phase phase);
+		void print(long lookups);
+};
 class OPERATIONS
 {
 	private:
@@ -30,35 +82,51 @@ class OPERATIONS
 		unordered_map<string, unsigned char> funct7;
 		unordered_map<string, int> uid;
 		unordered_map<string, unsigned char> type;
+		// Mnemonics expandPseudo rewrites, any other line is returned as it is
+		unordered_set<string> pseudo;
+		void loadImmediate(string rd, int value, vector<string> &expanded);
 		
 	public:
+		// Hash table lookups made so far on this thread
+		static thread_local long lookups;
 		OPERATIONS();
 		unsigned char setIns(int &ins, string op);
+		unsigned char getType(string op);
+		void splitIns(string &line, string &op, string &reg_list);
+		// Replaces a pseudo-instruction by real ones, other lines are returned unchanged
+		int expandPseudo(string ins_tac, vector<string> &expanded);
 };
 
 class REGISTERS
 {
 	private:
 		unordered_map<string, int> regcode;
-		unordered_map<string, ST_Entry> symbol_table;
+		// Table of the assembly running on this thread, owned by its Assembler
+		static thread_local SymbolTable* symbol_table;
 		string regex_reg;
 		vector<string> regex_reg_imm;
 		string regex_labels;
+		// Label values and linenumber are byte addresses when compressed instructions are emitted, set per thread like symbol_table
+		static thread_local bool byte_addressed;
 
 	public:
+		// Hash table lookups made so far on this thread
+		static thread_local long lookups;
 		REGISTERS();
+		void setByteAddressed(bool byte_addressed);
 		int setRegCode(int &ins, string reg, unsigned char type, int linenumber);
 		vector<int> extractRegisters(string reg, unsigned char type);
 		int extractImmediate(vector<int> &regs, string reg, unsigned char type, int imm_type);
 		int extractLabel(vector<int> &regs, string reg);
 		vector<int> matchReg(string reg, unsigned char type);
-		void setSymbolTable(unordered_map<string, ST_Entry> &symbol_table);
+		void setSymbolTable(SymbolTable &symbol_table);
+		// Forgets symbol_table if it is the one in use
+		void releaseSymbolTable(SymbolTable &symbol_table);
 		int getSymbolTableValue(string symbol);
 };
 class Map
 {
 	private:
-		static Map* instance;
 		REGISTERS* registers;
 		OPERATIONS* operations;
 		
@@ -71,16 +139,76 @@ class Map
 class Assembler
 {
 	private:
+		// Owns the containers below and frees them in one go with the Assembler, so it comes first
+		ARENA arena;
 		int baseAddress;
 		int runningAddress;
-		unordered_map<string, ST_Entry> symbol_table;
+		SymbolTable symbol_table;
 		unordered_map<char, char> escapeChars;
 		string regex_labels;
+		// regex_labels compiled once, it is matched on every line with a colon
+		regex label_regexp;
 		string regex_comment;
 		string regex_asciz;
+		// Line number and target label of every B type instruction
+		ArenaVector<pair<int, string>> branches;
+		// Line numbers (before relaxation) of branches rewritten as inverted branch + jal
+		ArenaVector<int> relaxed;
+		unordered_map<string, string> inverse;
+		// Emit RVC forms where possible, sizes holds the byte size of each emitted instruction
+		bool compress;
+		ArenaVector<unsigned char> sizes;
+		/*
+			Alignment in bytes requested before an instruction, keyed by its
+			line number before relaxation and by its emitted index after.
+			loop_align (0 when off) is requested before every back-edge target.
+		*/
+		ArenaIntMap aligns;
+		int loop_align;
+		// Number of instructions before relaxation
+		int instructions;
+		// Bytes of nop padding emitted before an instruction, only kept for padded ones
+		ArenaIntMap padding;
+		// Branches are read again from the input instead of kept, and output goes through fixed windows
+		bool streaming;
+		// The size of a default file buffer, larger windows cost more memory than the branch list saves
+		static constexpr int STREAM_WINDOW=1<<13;
+		STATS stats;
+		// Lookups made on this thread before the assembly started
+		long lookups_before;
+		// Points the shared encoder at this assembly's symbol table and addressing
+		void bindEncoder();
+		// getline and output with their time counted as read and write
+		bool readLine(ifstream &fin, string &line);
+		void writeLine(ofstream &fout, string line);
+		int shiftOf(int linenumber);
+		int alignOf(string vm_line);
+		/*
+			Padding only changes at aligned instructions, so the layout is
+			kept as the total padding in instructions up to and including
+			each of them, sorted by line, rather than as a line per instruction.
+		*/
+		void placeLines(vector<pair<int, int>> &stops);
+		// Line of an instruction before relaxation once relaxed branches and padding are placed
+		int lineOf(vector<pair<int, int>> &stops, int linenumber);
+		// Calls visit with the line number and target of every B type instruction in the text section
+		int scanBranches(string vmout, function<void(int, string&)> visit);
+		// Pads aligned instructions with nops and turns label values into line numbers
+		void alignLines();
+		// Byte address of each emitted instruction with c.nop padding before aligned ones
+		void placeAddresses(vector<int> &address);
+		int realInstructions(string ins_tac, int &index, vector<string> &lines);
+		int encodeCompressed(string ins_tac, int address, ofstream &fout);
 
 	public:
 		Assembler();
+		~Assembler();
+		void setCompressed(bool compress);
+		void setLoopAlign(int loop_align);
+		void setStats(bool enabled);
+		void setCounters(bool enabled);
+		void setStreaming(bool streaming);
+		void printStats();
 		int terminate(int code);
 		string extractLabel(string vm_line, bool sectionType);
 		string extractComment(string vm_line);
@@ -89,6 +217,12 @@ class Assembler
 		void printST();
 		// To create the symbol table
 		int firstPass(string vmout);
+		// Rewrites out of range branches and moves labels until offsets are stable
+		int relaxBranches(string vmout);
+		// Chooses 16 or 32 bit forms and turns label values into byte addresses
+		int layoutCompressed(string vmout);
+		// Encodes one real instruction and writes it to fout
+		int encodeIns(string ins_tac, int linenumber, ofstream &fout);
 		int secondPass(string vmout, string asmout);
 };
 #endif
\ No newline at end of file
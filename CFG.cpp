@@ -0,0 +1,171 @@
+#include "CFG.h"
+
+BasicBlock::BasicBlock(int start)
+{
+	this->start=start;
+	this->end=start;
+}
+void CFG::addEdge(int from, int to)
+{
+	if(to<0 || to>=(int)blocks.size())
+		return;
+	blocks[from].succ.push_back(to);
+	blocks[to].pred.push_back(from);
+}
+int CFG::build(vector<IR_Ins> &text)
+{
+	this->text=&text;
+	blocks.clear();
+	label_block.clear();
+
+	// A label starts a new block unless the current one holds no instruction yet
+	bool has_ins=false;
+	blocks.push_back(BasicBlock(0));
+	for(int i=0;i<(int)text.size();i++)
+	{
+		if(text[i].kind==1)
+		{
+			if(has_ins)
+			{
+				blocks.back().end=i;
+				blocks.push_back(BasicBlock(i));
+				has_ins=false;
+			}
+			label_block[text[i].label]=blocks.size()-1;
+		}
+		else if(text[i].isIns())
+		{
+			has_ins=true;
+			if(text[i].isControl() && i+1<(int)text.size())
+			{
+				blocks.back().end=i+1;
+				blocks.push_back(BasicBlock(i+1));
+				has_ins=false;
+			}
+		}
+	}
+	blocks.back().end=text.size();
+
+	for(int b=0;b<(int)blocks.size();b++)
+	{
+		int last=lastIns(b);
+		if(last<0 || !text[last].isControl())
+		{
+			addEdge(b, b+1);
+			continue;
+		}
+
+		IR_Ins &ir=text[last];
+		if(ir.type=='B' || ir.type=='J')
+		{
+			if(label_block.find(ir.label)==label_block.end())
+			{
+				perror("Invalid Label not found");
+				return 1;
+			}
+			addEdge(b, label_block[ir.label]);
+		}
+		// Calls return to the next instruction, jalr x0 is a return
+		if((ir.type=='B' && !ir.isUncondJump()) || ir.isCall())
+			addEdge(b, b+1);
+	}
+	return 0;
+}
+vector<BasicBlock>& CFG::getBlocks()
+{
+	return blocks;
+}
+int CFG::getBlock(string label)
+{
+	if(label_block.find(label)==label_block.end())
+		return -1;
+	return label_block[label];
+}
+vector<bool> CFG::reachable()
+{
+	vector<bool> seen(blocks.size(), false);
+	vector<int> st;
+	if(!blocks.empty())
+	{
+		st.push_back(0);
+		seen[0]=true;
+	}
+	while(!st.empty())
+	{
+		int b=st.back();
+		st.pop_back();
+		for(int s : blocks[b].succ)
+		{
+			if(!seen[s])
+			{
+				seen[s]=true;
+				st.push_back(s);
+			}
+		}
+	}
+	return seen;
+}
+int CFG::liveness()
+{
+	vector<IR_Ins> &text=*this->text;
+	for(BasicBlock &block : blocks)
+	{
+		block.def.reset();
+		block.use.reset();
+		for(int i=block.start;i<block.end;i++)
+		{
+			block.use|=text[i].getUses()&~block.def;
+			block.def|=text[i].getDefs();
+		}
+		block.live_in=block.use;
+		block.live_out.reset();
+	}
+
+	// Reverse order visits successors first for most blocks
+	int iterations=0;
+	bool changed=true;
+	while(changed)
+	{
+		changed=false;
+		iterations++;
+		for(int b=blocks.size()-1;b>=0;b--)
+		{
+			BasicBlock &block=blocks[b];
+			bitset<32> out;
+			int last=lastIns(b);
+			if(last>=0 && text[last].op=="jalr")
+				out.set();
+			for(int s : block.succ)
+				out|=blocks[s].live_in;
+			bitset<32> in=block.use|(out&~block.def);
+			if(out!=block.live_out || in!=block.live_in)
+			{
+				block.live_out=out;
+				block.live_in=in;
+				changed=true;
+			}
+		}
+	}
+	return iterations;
+}
+int CFG::lastIns(int b)
+{
+	vector<IR_Ins> &text=*this->text;
+	for(int i=blocks[b].end-1;i>=blocks[b].start;i--)
+		if(text[i].isIns())
+			return i;
+	return -1;
+}
+vector<bitset<32>> CFG::liveAfter(int b)
+{
+	vector<IR_Ins> &text=*this->text;
+	BasicBlock &block=blocks[b];
+	vector<bitset<32>> live(block.end-block.start);
+	bitset<32> current=block.live_out;
+	for(int i=block.end-1;i>=block.start;i--)
+	{
+		live[i-block.start]=current;
+		current=(current&~text[i].getDefs())|text[i].getUses();
+	}
+	return live;
+}
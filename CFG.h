@@ -0,0 +1,48 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "IR.h"
+
+struct BasicBlock
+{
+	// Entries [start, end) of the text IR, leading labels included
+	int start;
+	int end;
+	vector<int> succ;
+	vector<int> pred;
+	// Registers written in the block / read before being written in it
+	bitset<32> def;
+	bitset<32> use;
+	bitset<32> live_in;
+	bitset<32> live_out;
+	BasicBlock(int start);
+};
+class CFG
+{
+	private:
+		vector<IR_Ins>* text;
+		vector<BasicBlock> blocks;
+		unordered_map<string, int> label_block;
+		void addEdge(int from, int to);
+
+	public:
+		// Splits text at labels and after B, J and jalr
+		int build(vector<IR_Ins> &text);
+		vector<BasicBlock>& getBlocks();
+		int getBlock(string label);
+		// Blocks reachable from the first block
+		vector<bool> reachable();
+		/*
+			Iterative backward register liveness over the blocks.
+			Every register is live after a jalr since the caller or the
+			callee of an indirect call is unknown, none are live where
+			the program falls off the end.
+			Returns the number of iterations taken.
+		*/
+		int liveness();
+		// Live registers after each entry of block b, indexed from the block start
+		vector<bitset<32>> liveAfter(int b);
+		// Index of the last instruction of block b, -1 when it has none
+		int lastIns(int b);
+};
+#endif
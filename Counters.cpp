@@ -0,0 +1,86 @@
+#include "Counters.h"
+#include<cstring>
+#include<cstdio>
+#include<cerrno>
+#include<unistd.h>
+#ifdef __linux__
+#include<linux/perf_event.h>
+#include<sys/syscall.h>
+#endif
+
+COUNTERS* COUNTERS::instance=NULL;
+const char* COUNTERS::names[5]={"cycles", "instructions", "branch misses", "L1D misses", "LLC misses"};
+
+COUNTERS::COUNTERS()
+{
+	opened=false;
+	for(int i=0;i<5;i++)
+		fd[i]=-1;
+}
+COUNTERS* COUNTERS::getInstance()
+{
+	if(instance==NULL)
+		instance=new COUNTERS();
+	return instance;
+}
+int COUNTERS::open()
+{
+	int available=0;
+#ifdef __linux__
+	if(opened)
+	{
+		for(int i=0;i<5;i++)
+			available+=fd[i]>=0;
+		return available;
+	}
+	opened=true;
+	const unsigned int types[5]={PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+	const unsigned long long configs[5]={
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_L1D|(PERF_COUNT_HW_CACHE_OP_READ<<8)|(PERF_COUNT_HW_CACHE_RESULT_MISS<<16),
+		PERF_COUNT_HW_CACHE_LL|(PERF_COUNT_HW_CACHE_OP_READ<<8)|(PERF_COUNT_HW_CACHE_RESULT_MISS<<16),
+	};
+	int error=0;
+	// Opened one by one rather than as a group so that a missing event does not take the rest with it
+	for(int i=0;i<5;i++)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size=sizeof(attr);
+		attr.type=types[i];
+		attr.config=configs[i];
+		attr.exclude_kernel=1;
+		attr.exclude_hv=1;
+		attr.read_format=PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING;
+		fd[i]=syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if(fd[i]>=0)
+			available++;
+		else
+			error=errno;
+	}
+	if(available<5)
+	{
+		errno=error;
+		perror(available==0?"Hardware counters unavailable":"Some hardware counters unavailable");
+	}
+#endif
+	return available;
+}
+bool COUNTERS::isAvailable(Event event)
+{
+	return fd[event]>=0;
+}
+void COUNTERS::read(long long values[5])
+{
+	for(int i=0;i<5;i++)
+	{
+		values[i]=0;
+		// value, time enabled, time running
+		unsigned long long data[3];
+		if(fd[i]<0 || ::read(fd[i], data, sizeof(data))!=sizeof(data) || data[2]==0)
+			continue;
+		values[i]=data[2]<data[1]?(long long)((double)data[0]*data[1]/data[2]):data[0];
+	}
+}
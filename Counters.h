@@ -0,0 +1,28 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+/*
+	Hardware performance counters of the calling thread through Linux
+	perf_event_open, user space only. Counters the kernel refuses (no PMU
+	in a container or VM, perf_event_paranoid, seccomp) are left closed
+	and reported as unavailable; everything else keeps working.
+*/
+class COUNTERS
+{
+	private:
+		static COUNTERS* instance;
+		int fd[5];
+		bool opened;
+
+	public:
+		enum Event {CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES};
+		static const char* names[5];
+		COUNTERS();
+		static COUNTERS* getInstance();
+		// Opens the counters once, returns the number available
+		int open();
+		bool isAvailable(Event event);
+		// Current count of every counter, scaled when the kernel multiplexed it
+		void read(long long values[5]);
+};
+#endif
@@ -0,0 +1,204 @@
+#include "IR.h"
+
+IR_Ins::IR_Ins()
+{
+	kind=0;
+	type='\0';
+	rd=rs1=rs2=-1;
+	imm=0;
+}
+IR_Ins::IR_Ins(string op, unsigned char type, int rd, int rs1, int rs2, int imm, string label)
+{
+	this->kind=0;
+	this->op=op;
+	this->type=type;
+	this->rd=rd;
+	this->rs1=rs1;
+	this->rs2=rs2;
+	this->imm=imm;
+	this->label=label;
+}
+bool IR_Ins::isIns()
+{
+	return kind==0;
+}
+bool IR_Ins::isLoad()
+{
+	return kind==0 && (op=="lw" || op=="lb");
+}
+bool IR_Ins::isStore()
+{
+	return kind==0 && (op=="sw" || op=="sb");
+}
+bool IR_Ins::isFrameAccess()
+{
+	return (isLoad() || isStore()) && rs1==FRAME_REG;
+}
+bool IR_Ins::isControl()
+{
+	return kind==0 && (type=='B' || type=='J' || op=="jalr");
+}
+bool IR_Ins::isUncondJump()
+{
+	return kind==0 && ((op=="beq" && rs1==0 && rs2==0) || (op=="jal" && rd==0));
+}
+bool IR_Ins::isCall()
+{
+	return kind==0 && (op=="jal" || op=="jalr") && rd!=0;
+}
+bool IR_Ins::isAlign()
+{
+	if(kind!=2)
+		return false;
+	string directive=label.substr(0, label.find_first_of(" \t"));
+	return directive==".align" || directive==".p2align";
+}
+bitset<32> IR_Ins::getDefs()
+{
+	bitset<32> defs;
+	if(kind!=0)
+		return defs;
+	if(op=="ecall")
+	{
+		// Results are returned in a0 and a1
+		defs.set(10);
+		defs.set(11);
+	}
+	else if(rd>0)
+		defs.set(rd);
+	return defs;
+}
+bitset<32> IR_Ins::getUses()
+{
+	bitset<32> uses;
+	if(kind!=0)
+		return uses;
+	if(op=="ecall")
+	{
+		// Arguments and the call number are passed in a0 to a7
+		for(int i=10;i<=17;i++)
+			uses.set(i);
+	}
+	if(rs1>0)
+		uses.set(rs1);
+	if(rs2>0)
+		uses.set(rs2);
+	return uses;
+}
+string IR_Ins::toString()
+{
+	if(kind==1)
+		return label+":";
+	if(kind==2)
+		return label;
+
+	ostringstream out;
+	out<<op;
+	switch(type)
+	{
+		case 'R':out<<" x"<<rd<<",x"<<rs1<<",x"<<rs2;
+				break;
+		case 'I':if(isLoad() || op=="jalr")
+					out<<" x"<<rd<<","<<imm<<"(x"<<rs1<<")";
+				else
+					out<<" x"<<rd<<",x"<<rs1<<","<<imm;
+				break;
+		case 'S':out<<" x"<<rs2<<","<<imm<<"(x"<<rs1<<")";
+				break;
+		case 'B':out<<" x"<<rs1<<",x"<<rs2<<","<<label;
+				break;
+		case 'U':out<<" x"<<rd<<","<<imm;
+				break;
+		case 'J':out<<" x"<<rd<<","<<label;
+				break;
+	}
+	if(comment!="")
+		out<<" "<<comment;
+	return out.str();
+}
+
+int parseLine(IR_Ins &ir, string line)
+{
+	ir=IR_Ins();
+
+	// Empty lines are not kept in the IR
+	size_t first=line.find_first_not_of(" \t\r");
+	if(first==string::npos)
+		return 1;
+	line=line.substr(first, line.find_last_not_of(" \t\r")-first+1);
+
+	// Directives such as .align are kept as text like comments
+	if(line[0]=='#' || line[0]=='.')
+	{
+		ir.kind=2;
+		ir.label=line;
+		return 0;
+	}
+	size_t hash=line.find('#');
+	if(hash!=string::npos)
+	{
+		ir.comment=line.substr(hash);
+		line=line.substr(0, line.find_last_not_of(" \t", hash-1)+1);
+	}
+	if(line.back()==':')
+	{
+		ir.kind=1;
+		ir.label=line.substr(0, line.length()-1);
+		return 0;
+	}
+
+	istringstream iss(line);
+	string reg_list;
+	iss>>ir.op;
+	if(ir.op=="ecall" || ir.op=="nop")
+	{
+		ir.type='N';
+		return 0;
+	}
+	if(!(iss>>reg_list))
+	{
+		perror("Invalid Syntax");
+		return 2;
+	}
+	ir.type=Map::getInstance()->getOperations()->getType(ir.op);
+	if(ir.type=='\0')
+	{
+		perror("Invalid Operation");
+		return 3;
+	}
+
+	REGISTERS* registers=Map::getInstance()->getRegisters();
+	vector<int> regs=registers->extractRegisters(reg_list, ir.type);
+	if(ir.type=='I' || ir.type=='S' || ir.type=='U')
+		registers->extractImmediate(regs, reg_list, ir.type, 0);
+	if(ir.type=='B' || ir.type=='J')
+		ir.label=reg_list.substr(reg_list.rfind(',')+1);
+
+	// Expected number of registers and immediates for each format
+	unsigned int count=3;
+	if(ir.type=='B' || ir.type=='U')
+		count=2;
+	else if(ir.type=='J')
+		count=1;
+	if(regs.size()!=count)
+	{
+		perror("Invalid Syntax");
+		return 4;
+	}
+	switch(ir.type)
+	{
+		case 'R':ir.rd=regs[0];ir.rs1=regs[1];ir.rs2=regs[2];
+				break;
+		case 'I':ir.rd=regs[0];ir.rs1=regs[1];ir.imm=regs[2];
+				break;
+		case 'S':ir.rs2=regs[0];ir.rs1=regs[1];ir.imm=regs[2];
+				break;
+		case 'B':ir.rs1=regs[0];ir.rs2=regs[1];
+				break;
+		case 'U':ir.rd=regs[0];ir.imm=regs[1];
+				break;
+		case 'J':ir.rd=regs[0];
+				break;
+	}
+	return 0;
+}
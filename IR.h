@@ -0,0 +1,55 @@
+#ifndef IR_H
+#define IR_H
+
+#include "Assembler.h"
+#include<vector>
+#include<sstream>
+using namespace std;
+
+// Base register used by the compiler for stack slots (s0 / fp)
+#define FRAME_REG 8
+
+struct IR_Ins
+{
+	/*
+		kind can be used to denote
+		0 - instruction
+		1 - label
+		2 - comment
+	*/
+	int kind;
+	string op;
+	unsigned char type;
+	// Operands not used by the format are -1
+	int rd;
+	int rs1;
+	int rs2;
+	int imm;
+	// Label operand for B and J type, name for labels, text for comments and directives
+	string label;
+	// Trailing comment of the source line, written back unchanged
+	string comment;
+	IR_Ins();
+	IR_Ins(string op, unsigned char type, int rd, int rs1, int rs2, int imm, string label);
+	bool isIns();
+	bool isLoad();
+	bool isStore();
+	// Load or store addressed off FRAME_REG
+	bool isFrameAccess();
+	// Conditional or unconditional branch, jump or jalr
+	bool isControl();
+	// beq x0,x0 or jal x0 (j)
+	bool isUncondJump();
+	// jal or jalr that writes a link register and so returns to the next instruction
+	bool isCall();
+	// .align or .p2align directive, which belongs to the label after it
+	bool isAlign();
+	// Registers written and read, x0 is never included
+	bitset<32> getDefs();
+	bitset<32> getUses();
+	string toString();
+};
+
+// Parses one line of the text section
+int parseLine(IR_Ins &ir, string line);
+#endif
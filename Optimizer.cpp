@@ -0,0 +1,1323 @@
+#include "Optimizer.h"
+
+LatencyModel::LatencyModel()
+{
+	// 5-stage pipeline forwarding from EX only - a load result is usable 3 issues later
+	load=3;
+	alu=1;
+}
+SlotSet::SlotSet()
+{
+	all=false;
+}
+void SlotSet::merge(SlotSet &other)
+{
+	all=all || other.all;
+	bytes.insert(other.bytes.begin(), other.bytes.end());
+}
+void SlotSet::gen(int offset, int size)
+{
+	for(int i=0;i<size;i++)
+		bytes.insert(offset+i);
+}
+void SlotSet::kill(int offset, int size)
+{
+	// Once every byte may be live a store can not narrow it down
+	for(int i=0;i<size;i++)
+		bytes.erase(offset+i);
+}
+bool SlotSet::isLive(int offset, int size)
+{
+	if(all)
+		return true;
+	for(int i=0;i<size;i++)
+		if(bytes.find(offset+i)!=bytes.end())
+			return true;
+	return false;
+}
+FrameValue::FrameValue()
+{
+	kind=0;
+	value=0;
+}
+FrameValue::FrameValue(int kind, int value)
+{
+	this->kind=kind;
+	this->value=value;
+}
+bool FrameValue::merge(FrameValue &other)
+{
+	FrameValue old=*this;
+	if(other.kind==0 || (kind==other.kind && value==other.value))
+		return false;
+	if(kind==0)
+		*this=other;
+	else if(kind==2 || kind==4 || other.kind==2 || other.kind==4)
+		*this=FrameValue(4, 0);
+	else
+		// Different constants or a constant and some other value
+		*this=FrameValue(3, 0);
+	return kind!=old.kind || value!=old.value;
+}
+PassReport::PassReport(string name)
+{
+	this->name=name;
+	changed=removed=added=loads_removed=stores_removed=0;
+}
+Optimizer::Optimizer()
+{
+	next_vn=0;
+	promote=false;
+	resetValues();
+}
+void Optimizer::setLatencyModel(LatencyModel latency)
+{
+	this->latency=latency;
+}
+void Optimizer::setPeepholeRules(string rules_path)
+{
+	this->rules_path=rules_path;
+}
+void Optimizer::setPromoteSlots(bool promote)
+{
+	this->promote=promote;
+}
+void Optimizer::setReport(string report_path)
+{
+	this->report_path=report_path;
+}
+void Optimizer::resetValues()
+{
+	// Nothing is known at the start of a block except x0
+	reg_vn[0]=0;
+	for(int i=1;i<32;i++)
+		reg_vn[i]=++next_vn;
+	slot_vn.clear();
+}
+void Optimizer::killSlots(map<int, int> &slots, int offset, int size)
+{
+	// Forget every word slot overlapping [offset, offset+size)
+	map<int, int>::iterator it=slots.lower_bound(offset-3);
+	while(it!=slots.end() && it->first<offset+size)
+		it=slots.erase(it);
+}
+void Optimizer::writeReg(int reg)
+{
+	if(reg<=0)
+		return;
+	reg_vn[reg]=++next_vn;
+	// Slot offsets are relative to x8, moving it invalidates all of them
+	if(reg==FRAME_REG)
+		slot_vn.clear();
+}
+int Optimizer::findReg(int vn)
+{
+	for(int i=0;i<32;i++)
+		if(reg_vn[i]==vn)
+			return i;
+	return -1;
+}
+int Optimizer::readProgram(string vmout)
+{
+	ifstream fin(vmout, ios::in);
+	if(!fin)
+	{
+		perror("VM output file does not exist");
+		return 1;
+	}
+
+	header.clear();
+	text.clear();
+	string vm_line;
+	while(getline(fin, vm_line))
+	{
+		header.push_back(vm_line);
+		if(vm_line==".text")
+			break;
+	}
+	if(header.empty() || header.back()!=".text")
+	{
+		perror("Text section not found");
+		return 2;
+	}
+
+	// The first pass resolves data symbols so that la can be expanded
+	Assembler A;
+	if(A.firstPass(vmout)!=0)
+		return 4;
+
+	IR_Ins ir;
+	vector<string> expanded;
+	while(getline(fin, vm_line))
+	{
+		if(Map::getInstance()->getOperations()->expandPseudo(vm_line, expanded)!=0)
+			return 5;
+		for(string &line : expanded)
+		{
+			int code=parseLine(ir, line);
+			if(code==1)
+				continue;
+			if(code!=0)
+			{
+				cout<<vm_line<<endl;
+				return 3;
+			}
+			text.push_back(ir);
+		}
+	}
+	fin.close();
+	return 0;
+}
+int Optimizer::writeProgram(string optout)
+{
+	ofstream fout(optout, ios::out);
+	if(!fout)
+	{
+		perror("Unable to create optimized output");
+		return 1;
+	}
+	for(string &line : header)
+		fout<<line<<endl;
+	for(IR_Ins &ir : text)
+		fout<<ir.toString()<<endl;
+	fout.close();
+	return 0;
+}
+map<string, int> Optimizer::labelSizes()
+{
+	map<string, int> sizes;
+	string label="";
+	for(IR_Ins &ir : text)
+	{
+		if(ir.kind==1)
+		{
+			label=ir.label;
+			sizes[label]=0;
+		}
+		else if(ir.isIns() && label!="")
+			sizes[label]++;
+	}
+	return sizes;
+}
+int Optimizer::track(string name, int (Optimizer::*pass)())
+{
+	TR_Scope trace(name);
+	int ins=0, loads=0, stores=0;
+	for(IR_Ins &ir : text)
+	{
+		ins+=ir.isIns();
+		loads+=ir.isLoad();
+		stores+=ir.isStore();
+	}
+	int changed=(this->*pass)();
+	if(changed<0)
+		return changed;
+	for(IR_Ins &ir : text)
+	{
+		ins-=ir.isIns();
+		loads-=ir.isLoad();
+		stores-=ir.isStore();
+	}
+
+	unsigned int r=0;
+	while(r<reports.size() && reports[r].name!=name)
+		r++;
+	if(r==reports.size())
+		reports.push_back(PassReport(name));
+	reports[r].changed+=changed;
+	reports[r].removed+=max(ins, 0);
+	reports[r].added+=max(-ins, 0);
+	reports[r].loads_removed+=loads;
+	reports[r].stores_removed+=stores;
+	return changed;
+}
+int Optimizer::writeReport(string report_path)
+{
+	ofstream fout(report_path, ios::out);
+	if(!fout)
+	{
+		perror("Unable to create optimization report");
+		return 1;
+	}
+	// Labels are plain identifiers so nothing needs escaping
+	fout<<"{\n  \"passes\": [";
+	for(unsigned int r=0;r<reports.size();r++)
+	{
+		PassReport &p=reports[r];
+		fout<<(r==0?"\n":",\n")<<"    {\"name\": \""<<p.name<<"\", \"changed\": "<<p.changed
+			<<", \"instructions_removed\": "<<p.removed<<", \"instructions_added\": "<<p.added
+			<<", \"loads_removed\": "<<p.loads_removed<<", \"stores_removed\": "<<p.stores_removed<<"}";
+	}
+	fout<<"\n  ],\n  \"labels\": [";
+	map<string, int> after=labelSizes(), before=label_sizes;
+	for(pair<const string, int> &entry : after)
+		before.insert(make_pair(entry.first, 0));
+	bool first=true;
+	for(pair<const string, int> &entry : before)
+	{
+		int size=after.count(entry.first)?after[entry.first]:0;
+		int old_size=label_sizes.count(entry.first)?label_sizes[entry.first]:0;
+		fout<<(first?"\n":",\n")<<"    {\"label\": \""<<entry.first<<"\", \"before\": "<<old_size
+			<<", \"after\": "<<size<<", \"delta\": "<<size-old_size<<"}";
+		first=false;
+	}
+	fout<<"\n  ]\n}\n";
+	fout.close();
+	return 0;
+}
+int Optimizer::numberValues(bool remove_stores, bool forward_loads)
+{
+	/*
+		Local value numbering over each basic block.
+		Slots are only tracked for x8-relative accesses, two slots
+		are distinct when their word ranges do not overlap.
+	*/
+	CFG cfg;
+	if(cfg.build(text)!=0)
+		return 0;
+
+	vector<IR_Ins> result;
+	int changed=0;
+	for(BasicBlock &block : cfg.getBlocks())
+	{
+		resetValues();
+		for(int i=block.start;i<block.end;i++)
+		{
+			IR_Ins &ir=text[i];
+			if(!ir.isIns())
+			{
+				result.push_back(ir);
+				continue;
+			}
+
+			if(ir.isFrameAccess() && ir.op=="sw")
+			{
+				map<int, int>::iterator it=slot_vn.find(ir.imm);
+				if(remove_stores && it!=slot_vn.end() && it->second==reg_vn[ir.rs2])
+				{
+					changed++;
+					continue;
+				}
+				int vn=reg_vn[ir.rs2];
+				killSlots(slot_vn, ir.imm, 4);
+				slot_vn[ir.imm]=vn;
+			}
+			else if(ir.isFrameAccess() && ir.op=="lw")
+			{
+				map<int, int>::iterator it=slot_vn.find(ir.imm);
+				int vn=(it!=slot_vn.end())?it->second:++next_vn;
+				if(forward_loads && it!=slot_vn.end() && ir.rd!=FRAME_REG)
+				{
+					// Destination already holds the value
+					if(reg_vn[ir.rd]==vn)
+					{
+						changed++;
+						continue;
+					}
+					// Value is still in a register - reload becomes a move
+					int src=findReg(vn);
+					if(src>=0)
+					{
+						string comment=ir.comment;
+						ir=IR_Ins("addi", 'I', ir.rd, src, -1, 0, "");
+						ir.comment=comment;
+						changed++;
+					}
+				}
+				writeReg(ir.rd);
+				if(ir.rd>0)
+					reg_vn[ir.rd]=vn;
+				if(ir.rd!=FRAME_REG)
+					slot_vn[ir.imm]=vn;
+			}
+			else if(ir.isFrameAccess() && ir.op=="sb")
+				killSlots(slot_vn, ir.imm, 1);
+			else if(ir.isStore())
+				// Unknown base may alias any stack slot
+				slot_vn.clear();
+			else if(ir.op=="ecall")
+			{
+				// The environment call may read or write registers and memory
+				resetValues();
+			}
+			else
+				writeReg(ir.rd);
+
+			result.push_back(ir);
+		}
+	}
+	text=result;
+	return changed;
+}
+int Optimizer::materialize(IR_Ins &ir, int rd, int value, IR_Ins &upper)
+{
+	string comment=ir.comment;
+	if(value>=-2048 && value<2048)
+		ir=IR_Ins("addi", 'I', rd, 0, -1, value, "");
+	else if((value&4095)==0)
+		ir=IR_Ins("lui", 'U', rd, -1, -1, (unsigned int)value>>12, "");
+	else
+	{
+		// addi sign extends, so the upper part absorbs the borrow
+		int lo=((value&4095)^2048)-2048;
+		upper=IR_Ins("lui", 'U', rd, -1, -1, (((unsigned int)value-(unsigned int)lo)>>12)&1048575, "");
+		ir=IR_Ins("addi", 'I', rd, rd, -1, lo, "");
+		ir.comment=comment;
+		return 2;
+	}
+	ir.comment=comment;
+	return 1;
+}
+int Optimizer::propagateConstants()
+{
+	/*
+		Tracks registers and x8-relative slots holding known constants
+		through each block. Results that are known are rebuilt with the
+		cheapest single instruction, or lui + addi when the instruction
+		overwrites one of its own sources, which collapses lui/addi
+		chains. add/sub/xor with one constant operand use the immediate
+		form and identities such as addi rd,rd,0 are removed. The
+		instructions left without uses are removed by dead code elimination.
+	*/
+	CFG cfg;
+	if(cfg.build(text)!=0)
+		return 0;
+
+	int changed=0;
+	// lui to place before an entry, and entries to drop
+	map<int, IR_Ins> uppers;
+	vector<bool> dropped(text.size(), false);
+	for(BasicBlock &block : cfg.getBlocks())
+	{
+		bool known[32]={true};
+		int value[32]={0};
+		map<int, int> slots;
+		for(int i=block.start;i<block.end;i++)
+		{
+			IR_Ins &ir=text[i];
+			if(!ir.isIns())
+				continue;
+			string before=ir.toString();
+			bool result_known=false;
+			int result=0;
+
+			bool identity=ir.rd>0 && ir.rd==ir.rs1 && (((ir.op=="addi" || ir.op=="xori") && ir.imm==0)
+				|| ((ir.op=="add" || ir.op=="sub" || ir.op=="xor" || ir.op=="or") && ir.rs2==0));
+			if(identity)
+			{
+				dropped[i]=true;
+				changed++;
+				continue;
+			}
+
+			if(ir.isFrameAccess() && ir.op=="sw")
+			{
+				killSlots(slots, ir.imm, 4);
+				if(known[ir.rs2])
+					slots[ir.imm]=value[ir.rs2];
+			}
+			else if(ir.isFrameAccess() && ir.op=="sb")
+				killSlots(slots, ir.imm, 1);
+			else if(ir.isStore())
+				slots.clear();
+			else if(ir.op=="ecall")
+			{
+				for(int r=1;r<32;r++)
+					known[r]=false;
+				slots.clear();
+			}
+			else if(ir.isFrameAccess() && ir.op=="lw" && slots.find(ir.imm)!=slots.end())
+			{
+				result_known=true;
+				result=slots[ir.imm];
+			}
+			else if(ir.op=="lui")
+			{
+				result_known=true;
+				result=(unsigned int)ir.imm<<12;
+			}
+			else if((ir.op=="addi" || ir.op=="xori") && known[ir.rs1])
+			{
+				result_known=true;
+				result=(ir.op=="addi")?(int)((unsigned int)value[ir.rs1]+ir.imm):value[ir.rs1]^ir.imm;
+			}
+			else if(ir.type=='R' && known[ir.rs1] && known[ir.rs2])
+			{
+				unsigned int a=value[ir.rs1], b=value[ir.rs2];
+				result_known=true;
+				if(ir.op=="add")
+					result=a+b;
+				else if(ir.op=="sub")
+					result=a-b;
+				else if(ir.op=="and")
+					result=a&b;
+				else if(ir.op=="or")
+					result=a|b;
+				else if(ir.op=="xor")
+					result=a^b;
+				else if(ir.op=="sll")
+					result=a<<(b&31);
+				else if(ir.op=="srl")
+					result=a>>(b&31);
+				else
+					result_known=false;
+			}
+			else if(ir.op=="add" || ir.op=="sub" || ir.op=="xor")
+			{
+				// One constant operand that fits the 12 bit immediate
+				int reg=-1, imm=0;
+				if(known[ir.rs2])
+				{
+					reg=ir.rs1;
+					imm=(ir.op=="sub")?(int)(0u-(unsigned int)value[ir.rs2]):value[ir.rs2];
+				}
+				else if(known[ir.rs1] && ir.op!="sub")
+				{
+					reg=ir.rs2;
+					imm=value[ir.rs1];
+				}
+				if(reg>=0 && imm>=-2048 && imm<2048)
+				{
+					string comment=ir.comment;
+					ir=IR_Ins(ir.op=="xor"?"xori":"addi", 'I', ir.rd, reg, -1, imm, "");
+					ir.comment=comment;
+				}
+			}
+
+			if(result_known && ir.op!="lui" && ir.rd>0)
+			{
+				// A pair only pays when the old value of rd dies here
+				bool kills=ir.rd==ir.rs1 || ir.rd==ir.rs2;
+				IR_Ins copy=ir, upper;
+				if(materialize(copy, ir.rd, result, upper)==1)
+					ir=copy;
+				else if(kills && copy.toString()!=before)
+				{
+					ir=copy;
+					uppers[i]=upper;
+				}
+			}
+			if(ir.toString()!=before)
+				changed++;
+
+			// Record the result
+			bitset<32> defs=ir.getDefs();
+			for(int r=1;r<32;r++)
+				if(defs.test(r))
+					known[r]=false;
+			if(result_known && ir.rd>0)
+			{
+				known[ir.rd]=true;
+				value[ir.rd]=result;
+			}
+			if(defs.test(FRAME_REG))
+				slots.clear();
+		}
+	}
+
+	vector<IR_Ins> result;
+	for(int i=0;i<(int)text.size();i++)
+	{
+		if(uppers.find(i)!=uppers.end())
+			result.push_back(uppers[i]);
+		if(!dropped[i])
+			result.push_back(text[i]);
+	}
+	text=result;
+	return changed;
+}
+int Optimizer::eliminateSpillStores()
+{
+	// A store to a slot that already holds the stored value is dropped
+	return numberValues(true, false);
+}
+int Optimizer::forwardStores()
+{
+	// A reload of a slot whose value is still in a register is dropped or becomes addi
+	return numberValues(false, true);
+}
+int Optimizer::nextEntry(int i)
+{
+	// Index of the next label or instruction after i, comments are skipped
+	for(i++;i<(int)text.size();i++)
+		if(text[i].kind!=2)
+			return i;
+	return text.size();
+}
+int Optimizer::findLabel(string label)
+{
+	for(int i=0;i<(int)text.size();i++)
+		if(text[i].kind==1 && text[i].label==label)
+			return i;
+	return -1;
+}
+bool Optimizer::labelFollows(int i, string label)
+{
+	// True when label marks the position right after entry i
+	for(i=nextEntry(i);i<(int)text.size() && text[i].kind==1;i=nextEntry(i))
+		if(text[i].label==label)
+			return true;
+	return false;
+}
+bool Optimizer::moveBlock(string label, int &pos)
+{
+	/*
+		Moves the block starting at label to just after entry pos,
+		pos is updated to the new index of that entry.
+		Only blocks nothing falls into (preceded by an unconditional jump)
+		and that end in an unconditional jump are moved, so no other
+		fall-through edge changes.
+		Alignment directives right before the block move with it.
+	*/
+	int start=findLabel(label);
+	if(start<0)
+		return false;
+	while(start>0 && (text[start-1].kind==1 || text[start-1].isAlign()))
+		start--;
+	int prev=start-1;
+	while(prev>=0 && text[prev].kind==2)
+		prev--;
+	if(prev<0 || !text[prev].isUncondJump())
+		return false;
+
+	int end=nextEntry(start);
+	while(end<(int)text.size() && text[end].kind==1)
+		end=nextEntry(end);
+	while(end<(int)text.size() && text[end].kind!=1 && !text[end].isControl())
+		end++;
+	if(end>=(int)text.size() || !text[end].isUncondJump())
+		return false;
+	if(pos>=prev && pos<=end)
+		return false;
+
+	vector<IR_Ins> block(text.begin()+start, text.begin()+end+1);
+	text.erase(text.begin()+start, text.begin()+end+1);
+	if(pos>end)
+		pos-=block.size();
+	text.insert(text.begin()+pos+1, block.begin(), block.end());
+	return true;
+}
+int Optimizer::invertBranches()
+{
+	/*
+		bXX rs1,rs2,L1          bYY rs1,rs2,L2
+		beq x0,x0,L2     ->  L1:
+		L1:
+		When L1 is elsewhere its block is first moved after the jump.
+	*/
+	map<string, string> inverse={
+		{"beq", "bne"}, {"bne", "beq"},
+		{"blt", "bge"}, {"bge", "blt"},
+		{"bltu", "bgeu"}, {"bgeu", "bltu"},
+	};
+	int inverted=0;
+	for(int i=0;i<(int)text.size();i++)
+	{
+		if(text[i].type!='B' || text[i].isUncondJump() || !text[i].isIns())
+			continue;
+		int j=nextEntry(i);
+		if(j>=(int)text.size() || !text[j].isUncondJump())
+			continue;
+		if(!labelFollows(j, text[i].label))
+		{
+			int old_j=j;
+			if(!moveBlock(text[i].label, j))
+				continue;
+			// The moved block may have come from before the branch
+			i-=old_j-j;
+		}
+		text[i].op=inverse[text[i].op];
+		text[i].label=text[j].label;
+		text.erase(text.begin()+j);
+		inverted++;
+	}
+	return inverted;
+}
+int Optimizer::removeJumpsToNext()
+{
+	int removed=0;
+	for(int i=0;i<(int)text.size();i++)
+	{
+		// Taken or not, a branch to the next label ends up there
+		if((text[i].isUncondJump() || (text[i].kind==0 && text[i].type=='B')) && labelFollows(i, text[i].label))
+		{
+			text.erase(text.begin()+i);
+			i--;
+			removed++;
+		}
+	}
+	return removed;
+}
+string Optimizer::finalTarget(string label)
+{
+	// Follows labels whose first instruction is an unconditional jump - a cycle stops the walk
+	set<string> seen;
+	while(seen.insert(label).second)
+	{
+		int i=findLabel(label);
+		if(i<0)
+			break;
+		while(i<(int)text.size() && !text[i].isIns())
+			i++;
+		if(i>=(int)text.size() || !text[i].isUncondJump())
+			break;
+		label=text[i].label;
+	}
+	return label;
+}
+int Optimizer::threadJumps()
+{
+	int threaded=0;
+	for(IR_Ins &ir : text)
+	{
+		if(!ir.isIns() || (ir.type!='B' && ir.type!='J'))
+			continue;
+		string target=finalTarget(ir.label);
+		if(target!=ir.label)
+		{
+			ir.label=target;
+			threaded++;
+		}
+	}
+	return threaded;
+}
+int Optimizer::removeUnreachable()
+{
+	// Labels are kept so that the symbol table stays complete, only instructions go
+	CFG cfg;
+	if(cfg.build(text)!=0)
+		return 0;
+	vector<bool> live=cfg.reachable();
+	vector<BasicBlock> &blocks=cfg.getBlocks();
+
+	vector<IR_Ins> result;
+	int removed=0;
+	for(int b=0;b<(int)blocks.size();b++)
+	{
+		for(int i=blocks[b].start;i<blocks[b].end;i++)
+		{
+			if(!live[b] && text[i].isIns())
+			{
+				removed++;
+				continue;
+			}
+			result.push_back(text[i]);
+		}
+	}
+	text=result;
+	return removed;
+}
+int Optimizer::removeDeadWrites()
+{
+	// Instructions without side effects whose result is never read
+	CFG cfg;
+	if(cfg.build(text)!=0)
+		return 0;
+	cfg.liveness();
+	vector<BasicBlock> &blocks=cfg.getBlocks();
+
+	vector<bool> dead(text.size(), false);
+	int removed=0;
+	for(int b=0;b<(int)blocks.size();b++)
+	{
+		vector<bitset<32>> live=cfg.liveAfter(b);
+		for(int i=blocks[b].start;i<blocks[b].end;i++)
+		{
+			IR_Ins &ir=text[i];
+			if(!ir.isIns() || ir.isStore() || ir.isControl() || ir.type=='N')
+				continue;
+			bitset<32> defs=ir.getDefs();
+			if(defs.any() && (defs&live[i-blocks[b].start]).none())
+			{
+				dead[i]=true;
+				removed++;
+			}
+		}
+	}
+
+	vector<IR_Ins> result;
+	for(int i=0;i<(int)text.size();i++)
+		if(!dead[i])
+			result.push_back(text[i]);
+	text=result;
+	return removed;
+}
+bool Optimizer::frameEscapes()
+{
+	// x8 used other than as a base address may let other registers point into the frame
+	for(IR_Ins &ir : text)
+	{
+		if(!ir.isIns())
+			continue;
+		if(ir.getDefs().test(FRAME_REG))
+			return true;
+		bitset<32> uses=ir.getUses();
+		if(ir.isFrameAccess())
+		{
+			uses.reset(FRAME_REG);
+			if(ir.isStore() && ir.rs2==FRAME_REG)
+				return true;
+		}
+		if(uses.test(FRAME_REG))
+			return true;
+	}
+	return false;
+}
+void Optimizer::slotTransfer(IR_Ins &ir, SlotSet &live)
+{
+	// Steps the live slot bytes backwards over one instruction
+	if(!ir.isIns())
+		return;
+	int size=(ir.op=="lw" || ir.op=="sw")?4:1;
+	if(ir.isFrameAccess() && ir.isStore())
+	{
+		if(!live.all)
+			live.kill(ir.imm, size);
+	}
+	else if(ir.isFrameAccess())
+		live.gen(ir.imm, size);
+	else if(ir.isLoad() || ir.op=="ecall")
+		live.all=true;
+}
+int Optimizer::removeDeadStores()
+{
+	/*
+		Backward liveness of x8-relative slot bytes over the CFG.
+		A store none of whose bytes are read again is removed.
+		Slots are live after jalr (a return or an indirect call into
+		unknown code), dead where the program ends.
+	*/
+	if(frameEscapes())
+		return 0;
+	CFG cfg;
+	if(cfg.build(text)!=0)
+		return 0;
+	vector<BasicBlock> &blocks=cfg.getBlocks();
+	vector<SlotSet> live_in(blocks.size());
+
+	bool changed=true;
+	while(changed)
+	{
+		changed=false;
+		for(int b=blocks.size()-1;b>=0;b--)
+		{
+			SlotSet live;
+			int last=cfg.lastIns(b);
+			if(last>=0 && text[last].op=="jalr")
+				live.all=true;
+			for(int s : blocks[b].succ)
+				live.merge(live_in[s]);
+			for(int i=blocks[b].end-1;i>=blocks[b].start;i--)
+				slotTransfer(text[i], live);
+			if(live.all!=live_in[b].all || live.bytes!=live_in[b].bytes)
+			{
+				live_in[b]=live;
+				changed=true;
+			}
+		}
+	}
+
+	vector<bool> dead(text.size(), false);
+	int removed=0;
+	for(int b=0;b<(int)blocks.size();b++)
+	{
+		SlotSet live;
+		int last=cfg.lastIns(b);
+		if(last>=0 && text[last].op=="jalr")
+			live.all=true;
+		for(int s : blocks[b].succ)
+			live.merge(live_in[s]);
+		for(int i=blocks[b].end-1;i>=blocks[b].start;i--)
+		{
+			IR_Ins &ir=text[i];
+			if(ir.isFrameAccess() && ir.isStore() && !live.isLive(ir.imm, ir.op=="sw"?4:1))
+			{
+				dead[i]=true;
+				removed++;
+				continue;
+			}
+			slotTransfer(ir, live);
+		}
+	}
+
+	vector<IR_Ins> result;
+	for(int i=0;i<(int)text.size();i++)
+		if(!dead[i])
+			result.push_back(text[i]);
+	text=result;
+	return removed;
+}
+void Optimizer::frameTransfer(IR_Ins &ir, vector<FrameValue> &regs)
+{
+	bitset<32> defs=ir.getDefs();
+	if(!ir.isIns() || defs.none())
+		return;
+	bool may_point=false;
+	bitset<32> uses=ir.getUses();
+	for(int r=1;r<32;r++)
+		if(uses.test(r) && (regs[r].kind==2 || regs[r].kind==4))
+			may_point=true;
+
+	FrameValue result(may_point?4:3, 0);
+	if(ir.op=="lui")
+		result=FrameValue(1, (unsigned int)ir.imm<<12);
+	else if(ir.isLoad() || ir.type=='J' || ir.op=="jalr" || ir.op=="ecall")
+		// No frame address is ever stored, so none can be loaded, return addresses and results of calls are not either
+		result=FrameValue(3, 0);
+	else if(ir.op=="addi" || ir.op=="add" || ir.op=="sub")
+	{
+		FrameValue a=regs[ir.rs1];
+		FrameValue b=ir.op=="addi"?FrameValue(1, ir.imm):regs[ir.rs2];
+		if(ir.op=="sub" && b.kind==1)
+			b.value=(int)(0u-(unsigned int)b.value);
+		if(ir.op=="add" && a.kind==1 && b.kind==2)
+			swap(a, b);
+		if((a.kind==1 || a.kind==2) && b.kind==1)
+			result=FrameValue(a.kind, (int)((unsigned int)a.value+(unsigned int)b.value));
+		else if(ir.op=="sub" && a.kind==2 && b.kind==2)
+			result=FrameValue(3, 0);
+	}
+	for(int r=1;r<32;r++)
+		if(defs.test(r))
+			regs[r]=result;
+}
+bool Optimizer::frameOffsets(CFG &cfg, map<int, int> &offsets)
+{
+	/*
+		Forward analysis of what each register may point to. Addresses
+		built from constants (lui/addi of data labels) are taken not to
+		alias the frame, any other base that may hold a frame address at
+		an unknown offset, such as a stack pointer that differs between
+		paths, makes the whole frame unsafe.
+	*/
+	vector<BasicBlock> &blocks=cfg.getBlocks();
+	if(blocks.empty())
+		return true;
+	vector<vector<FrameValue>> in(blocks.size(), vector<FrameValue>(32));
+	for(int r=1;r<32;r++)
+		in[0][r]=FrameValue(4, 0);
+	in[0][0]=FrameValue(1, 0);
+	in[0][FRAME_REG]=FrameValue(2, 0);
+	bool changed=true;
+	while(changed)
+	{
+		changed=false;
+		for(int b=0;b<(int)blocks.size();b++)
+		{
+			// x0 is set in every block that has been reached
+			if(in[b][0].kind==0)
+				continue;
+			vector<FrameValue> regs=in[b];
+			for(int i=blocks[b].start;i<blocks[b].end;i++)
+				frameTransfer(text[i], regs);
+			for(int s : blocks[b].succ)
+				for(int r=0;r<32;r++)
+					if(in[s][r].merge(regs[r]))
+						changed=true;
+		}
+	}
+
+	for(int b=0;b<(int)blocks.size();b++)
+	{
+		if(in[b][0].kind==0)
+			continue;
+		vector<FrameValue> regs=in[b];
+		for(int i=blocks[b].start;i<blocks[b].end;i++)
+		{
+			IR_Ins &ir=text[i];
+			if(!ir.isIns())
+				continue;
+			if(ir.op=="jalr" || ir.getDefs().test(FRAME_REG))
+				return false;
+			if(ir.isLoad() || ir.isStore())
+			{
+				if(regs[ir.rs1].kind==4)
+					return false;
+				if(regs[ir.rs1].kind==2)
+					offsets[i]=(int)((unsigned int)regs[ir.rs1].value+(unsigned int)ir.imm);
+				if(ir.isStore() && (regs[ir.rs2].kind==2 || regs[ir.rs2].kind==4))
+					return false;
+			}
+			frameTransfer(ir, regs);
+		}
+	}
+	return true;
+}
+int Optimizer::promoteSlots()
+{
+	/*
+		Word slots of x8 that no other access overlaps are moved into
+		callee-saved registers the program never uses. Slots are found
+		by frameOffsets, so x8 plus a known constant (a stack pointer,
+		or lui/addi added to x8) addresses them as well as x8 itself.
+		Live intervals in text order come from backward slot liveness
+		over the CFG and are packed by linear scan. Loads become
+		addi rd,r,0 and stores addi r,rs,0, which the dead code passes
+		then clean up. Slots read before being written keep their
+		memory, and nothing is promoted when a jalr may hand the frame
+		to unknown code.
+	*/
+	CFG cfg;
+	if(cfg.build(text)!=0)
+		return 0;
+	map<int, int> offsets;
+	if(!frameOffsets(cfg, offsets))
+		return 0;
+	bitset<32> used;
+	for(IR_Ins &ir : text)
+		if(ir.isIns())
+			used|=ir.getDefs()|ir.getUses();
+	set<pair<int, int>> accesses;
+	for(const pair<const int, int> &o : offsets)
+		accesses.insert(make_pair(o.second, (text[o.first].op=="lw" || text[o.first].op=="sw")?4:1));
+	vector<int> free_regs;
+	for(int r : {9, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27})
+		if(!used.test(r))
+			free_regs.push_back(r);
+
+	// Candidate slots, only ever accessed as the same whole word
+	map<int, int> slot;
+	vector<int> candidates;
+	for(const pair<int, int> &a : accesses)
+	{
+		if(a.second!=4)
+			continue;
+		bool alone=true;
+		for(const pair<int, int> &b : accesses)
+			if(b!=a && b.first<a.first+4 && a.first<b.first+b.second)
+				alone=false;
+		if(alone)
+		{
+			slot[a.first]=candidates.size();
+			candidates.push_back(a.first);
+		}
+	}
+	int k=candidates.size();
+	if(k==0 || free_regs.empty())
+		return 0;
+
+	vector<BasicBlock> &blocks=cfg.getBlocks();
+	vector<vector<bool>> live_in(blocks.size(), vector<bool>(k, false));
+	bool changed=true;
+	while(changed)
+	{
+		changed=false;
+		for(int b=blocks.size()-1;b>=0;b--)
+		{
+			vector<bool> live(k, false);
+			for(int s : blocks[b].succ)
+				for(int c=0;c<k;c++)
+					if(live_in[s][c])
+						live[c]=true;
+			for(int i=blocks[b].end-1;i>=blocks[b].start;i--)
+				if(offsets.count(i) && slot.count(offsets[i]))
+					live[slot[offsets[i]]]=text[i].isLoad();
+			if(live!=live_in[b])
+			{
+				live_in[b]=live;
+				changed=true;
+			}
+		}
+	}
+
+	// Interval of each slot: every instruction it is live after or accessed by
+	vector<int> first(k, text.size()), last(k, -1);
+	for(int b=0;b<(int)blocks.size();b++)
+	{
+		vector<bool> live(k, false);
+		for(int s : blocks[b].succ)
+			for(int c=0;c<k;c++)
+				if(live_in[s][c])
+					live[c]=true;
+		for(int i=blocks[b].end-1;i>=blocks[b].start;i--)
+		{
+			if(!text[i].isIns())
+				continue;
+			int accessed=-1;
+			if(offsets.count(i) && slot.count(offsets[i]))
+				accessed=slot[offsets[i]];
+			for(int c=0;c<k;c++)
+				if(live[c] || c==accessed)
+				{
+					first[c]=min(first[c], i);
+					last[c]=max(last[c], i);
+				}
+			if(accessed>=0)
+				live[accessed]=text[i].isLoad();
+		}
+	}
+
+	// Linear scan, when registers run out the interval ending last is left in memory
+	vector<int> order, reg(k, -1);
+	for(int c=0;c<k;c++)
+		if(last[c]>=0 && (blocks.empty() || !live_in[0][c]))
+			order.push_back(c);
+	sort(order.begin(), order.end(), [&](int a, int b)
+	{
+		return first[a]<first[b];
+	});
+	vector<int> active;
+	for(int c : order)
+	{
+		for(int j=active.size()-1;j>=0;j--)
+			if(last[active[j]]<first[c])
+			{
+				free_regs.push_back(reg[active[j]]);
+				active.erase(active.begin()+j);
+			}
+		if(!free_regs.empty())
+		{
+			reg[c]=free_regs.back();
+			free_regs.pop_back();
+			active.push_back(c);
+			continue;
+		}
+		int spill=c;
+		for(int a : active)
+			if(last[a]>last[spill])
+				spill=a;
+		if(spill!=c)
+		{
+			reg[c]=reg[spill];
+			reg[spill]=-1;
+			replace(active.begin(), active.end(), spill, c);
+		}
+	}
+
+	int promoted=0;
+	for(const pair<const int, int> &o : offsets)
+	{
+		if(!slot.count(o.second) || reg[slot[o.second]]<0)
+			continue;
+		IR_Ins &ir=text[o.first];
+		int r=reg[slot[o.second]];
+		string comment=ir.comment;
+		if(ir.isLoad())
+			ir=IR_Ins("addi", 'I', ir.rd, r, -1, 0, "");
+		else
+			ir=IR_Ins("addi", 'I', r, ir.rs2, -1, 0, "");
+		ir.comment=comment;
+		promoted++;
+	}
+	return promoted;
+}
+int Optimizer::eliminateDeadCode()
+{
+	// Removing a store can make the stored register dead and the other way round
+	int removed=0, changed=1;
+	while(changed!=0)
+	{
+		changed=removeDeadWrites()+removeDeadStores();
+		removed+=changed;
+	}
+	return removed;
+}
+int Optimizer::latencyOf(IR_Ins &ir)
+{
+	return ir.isLoad()?latency.load:latency.alu;
+}
+int Optimizer::countStalls(vector<IR_Ins> &seq)
+{
+	int ready[32]={0};
+	int cycle=0, stalls=0;
+	for(IR_Ins &ir : seq)
+	{
+		if(!ir.isIns())
+			continue;
+		int start=cycle;
+		bitset<32> uses=ir.getUses();
+		for(int r=1;r<32;r++)
+			if(uses.test(r) && ready[r]>start)
+				start=ready[r];
+		stalls+=start-cycle;
+		cycle=start+1;
+		bitset<32> defs=ir.getDefs();
+		for(int r=1;r<32;r++)
+			if(defs.test(r))
+				ready[r]=start+latencyOf(ir);
+	}
+	return stalls;
+}
+bool Optimizer::mustPrecede(IR_Ins &a, IR_Ins &b)
+{
+	// Register dependences
+	if((a.getDefs()&(b.getUses()|b.getDefs())).any() || (a.getUses()&b.getDefs()).any())
+		return true;
+
+	// Memory dependences - only x8-relative accesses with disjoint bytes are independent
+	bool a_mem=a.isLoad() || a.isStore();
+	bool b_mem=b.isLoad() || b.isStore();
+	if(!a_mem || !b_mem || (!a.isStore() && !b.isStore()))
+		return false;
+	if(!a.isFrameAccess() || !b.isFrameAccess())
+		return true;
+	int a_size=(a.op=="lw" || a.op=="sw")?4:1;
+	int b_size=(b.op=="lw" || b.op=="sw")?4:1;
+	return a.imm<b.imm+b_size && b.imm<a.imm+a_size;
+}
+vector<IR_Ins> Optimizer::scheduleRegion(vector<IR_Ins> &region)
+{
+	/*
+		List scheduling of a straight line region.
+		Priority is the latency weighted path length to the end of
+		the region, ties keep the original order.
+	*/
+	int n=region.size();
+	vector<vector<int>> succ(n);
+	vector<int> preds(n, 0);
+	for(int i=0;i<n;i++)
+		for(int j=i+1;j<n;j++)
+			if(mustPrecede(region[i], region[j]))
+			{
+				succ[i].push_back(j);
+				preds[j]++;
+			}
+
+	vector<int> priority(n, 0);
+	for(int i=n-1;i>=0;i--)
+	{
+		priority[i]=latencyOf(region[i]);
+		for(int j : succ[i])
+			priority[i]=max(priority[i], latencyOf(region[i])+priority[j]);
+	}
+
+	vector<int> earliest(n, 0);
+	vector<bool> done(n, false);
+	vector<IR_Ins> order;
+	int cycle=0;
+	while((int)order.size()<n)
+	{
+		int pick=-1;
+		for(int i=0;i<n;i++)
+		{
+			if(done[i] || preds[i]!=0)
+				continue;
+			if(pick<0)
+			{
+				pick=i;
+				continue;
+			}
+			// Prefer instructions that can issue now, then the longest path
+			bool i_now=earliest[i]<=cycle, pick_now=earliest[pick]<=cycle;
+			if(i_now!=pick_now)
+			{
+				if(i_now)
+					pick=i;
+			}
+			else if(!i_now)
+			{
+				if(earliest[i]<earliest[pick])
+					pick=i;
+			}
+			else if(priority[i]>priority[pick])
+				pick=i;
+		}
+		cycle=max(cycle, earliest[pick]);
+		done[pick]=true;
+		order.push_back(region[pick]);
+		for(int j : succ[pick])
+		{
+			preds[j]--;
+			bool raw=(region[pick].getDefs()&region[j].getUses()).any();
+			earliest[j]=max(earliest[j], cycle+(raw?latencyOf(region[pick]):1));
+		}
+		cycle++;
+	}
+	return order;
+}
+int Optimizer::scheduleBlocks()
+{
+	/*
+		Regions are runs of instructions inside a block without labels,
+		comments, control transfers, ecall or nop between them, so
+		block boundaries and padding stay where they are.
+	*/
+	int removed=0;
+	int i=0;
+	while(i<(int)text.size())
+	{
+		int j=i;
+		while(j<(int)text.size() && text[j].isIns() && !text[j].isControl() && text[j].type!='N')
+			j++;
+		if(j-i>1)
+		{
+			vector<IR_Ins> region(text.begin()+i, text.begin()+j);
+			vector<IR_Ins> order=scheduleRegion(region);
+			int before=countStalls(region), after=countStalls(order);
+			if(after<before)
+			{
+				copy(order.begin(), order.end(), text.begin()+i);
+				removed+=before-after;
+			}
+		}
+		i=j+1;
+	}
+	return removed;
+}
+int Optimizer::applyPeepholeRules()
+{
+	Peephole P;
+	if(P.loadRules(rules_path)!=0)
+		return -1;
+	return P.apply(text);
+}
+int Optimizer::simplifyControlFlow(int counts[4])
+{
+	// Control flow passes enable each other, repeat until nothing changes
+	int total=0, changed=1;
+	while(changed!=0)
+	{
+		int t=track("thread_jumps", &Optimizer::threadJumps);
+		int i=track("invert_branches", &Optimizer::invertBranches);
+		int j=track("remove_jumps_to_next", &Optimizer::removeJumpsToNext);
+		int u=track("remove_unreachable", &Optimizer::removeUnreachable);
+		counts[0]+=t;
+		counts[1]+=i;
+		counts[2]+=j;
+		counts[3]+=u;
+		changed=t+i+j+u;
+		total+=changed;
+	}
+	return total;
+}
+int Optimizer::run(string vmout, string optout)
+{
+	TR_Scope trace("optimize", vmout);
+	int code=readProgram(vmout);
+	if(code!=0)
+		return code;
+
+	label_sizes=labelSizes();
+	reports.clear();
+	cout<<"\nCONSTANTS FOLDED : "<<track("propagate_constants", &Optimizer::propagateConstants)<<endl;
+	cout<<"LOADS FORWARDED : "<<track("forward_stores", &Optimizer::forwardStores)<<endl;
+	cout<<"SPILL STORES REMOVED : "<<track("eliminate_spill_stores", &Optimizer::eliminateSpillStores)<<endl;
+	if(rules_path!="")
+	{
+		int applied=track("peephole_rules", &Optimizer::applyPeepholeRules);
+		if(applied<0)
+			return 5;
+		cout<<"PEEPHOLE RULES APPLIED : "<<applied<<endl;
+	}
+
+	int counts[4]={0, 0, 0, 0};
+	simplifyControlFlow(counts);
+	if(promote)
+		cout<<"SLOT ACCESSES PROMOTED : "<<track("promote_slots", &Optimizer::promoteSlots)<<endl;
+	int dead=track("eliminate_dead_code", &Optimizer::eliminateDeadCode);
+	// Emptied blocks can leave jumps to the label right after them
+	if(simplifyControlFlow(counts)>0)
+		dead+=track("eliminate_dead_code", &Optimizer::eliminateDeadCode);
+	cout<<"JUMPS THREADED : "<<counts[0]<<endl;
+	cout<<"BRANCHES INVERTED : "<<counts[1]<<endl;
+	cout<<"JUMPS TO NEXT REMOVED : "<<counts[2]<<endl;
+	cout<<"UNREACHABLE INSTRUCTIONS REMOVED : "<<counts[3]<<endl;
+	cout<<"DEAD INSTRUCTIONS REMOVED : "<<dead<<endl;
+	cout<<"ESTIMATED STALL CYCLES REMOVED : "<<track("schedule_blocks", &Optimizer::scheduleBlocks)<<endl;
+
+	if(report_path!="" && writeReport(report_path)!=0)
+		return 6;
+
+	// Label positions are recomputed when the first pass reads the optimized program
+	return writeProgram(optout)==0?0:4;
+}
@@ -0,0 +1,131 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "CFG.h"
+#include "Peephole.h"
+#include<map>
+#include<set>
+
+// Live bytes of x8-relative stack slots, all is set when any byte may be read
+struct SlotSet
+{
+	bool all;
+	set<int> bytes;
+	SlotSet();
+	void merge(SlotSet &other);
+	void gen(int offset, int size);
+	void kill(int offset, int size);
+	bool isLive(int offset, int size);
+};
+// What a register may hold as an address, for slot promotion
+struct FrameValue
+{
+	/*
+		kind can be used to denote
+		0 - not reached yet
+		1 - the constant value (data addresses are built this way)
+		2 - FRAME_REG plus value
+		3 - a value that is not a frame address
+		4 - anything, including frame addresses
+	*/
+	int kind;
+	int value;
+	FrameValue();
+	FrameValue(int kind, int value);
+	// Returns true when this value changed
+	bool merge(FrameValue &other);
+};
+// Cycles after issue until an instruction's result can be used by the next one
+struct LatencyModel
+{
+	int load;
+	int alu;
+	LatencyModel();
+};
+// Effect of one pass on the program, summed over every time it ran
+struct PassReport
+{
+	string name;
+	int changed;
+	int removed;
+	int added;
+	int loads_removed;
+	int stores_removed;
+	PassReport(string name);
+};
+class Optimizer
+{
+	private:
+		// Lines up to and including ".text" - copied to the output unchanged
+		vector<string> header;
+		vector<IR_Ins> text;
+		// Value number of every register and of known x8-relative word slots
+		int next_vn;
+		int reg_vn[32];
+		map<int, int> slot_vn;
+		LatencyModel latency;
+		// Peephole rule file, no rules are applied when empty
+		string rules_path;
+		// Move x8 slots into unused callee-saved registers
+		bool promote;
+		// Machine readable report, not written when report_path is empty
+		string report_path;
+		vector<PassReport> reports;
+		map<string, int> label_sizes;
+		// Runs a pass and adds its effect to reports
+		int track(string name, int (Optimizer::*pass)());
+		// Instructions from each label to the next one
+		map<string, int> labelSizes();
+		void resetValues();
+		void killSlots(map<int, int> &slots, int offset, int size);
+		void writeReg(int reg);
+		int findReg(int vn);
+		int numberValues(bool remove_stores, bool forward_loads);
+		int nextEntry(int i);
+		int findLabel(string label);
+		bool labelFollows(int i, string label);
+		bool moveBlock(string label, int &pos);
+		string finalTarget(string label);
+		bool frameEscapes();
+		void frameTransfer(IR_Ins &ir, vector<FrameValue> &regs);
+		// Frame offset of every load and store off FRAME_REG plus a known constant, false when another access may alias the frame
+		bool frameOffsets(CFG &cfg, map<int, int> &offsets);
+		// Rewrites ir to set rd to value, returns 2 when upper (a lui) must go before it
+		int materialize(IR_Ins &ir, int rd, int value, IR_Ins &upper);
+		void slotTransfer(IR_Ins &ir, SlotSet &live);
+		int latencyOf(IR_Ins &ir);
+		bool mustPrecede(IR_Ins &a, IR_Ins &b);
+		vector<IR_Ins> scheduleRegion(vector<IR_Ins> &region);
+
+	public:
+		Optimizer();
+		void setLatencyModel(LatencyModel latency);
+		void setPeepholeRules(string rules_path);
+		void setPromoteSlots(bool promote);
+		void setReport(string report_path);
+		// Estimated in-order issue stalls of a straight line sequence
+		int countStalls(vector<IR_Ins> &seq);
+		int readProgram(string vmout);
+		int writeProgram(string optout);
+		int writeReport(string report_path);
+		// Each pass returns the number of instructions it changed
+		int eliminateSpillStores();
+		int applyPeepholeRules();
+		int forwardStores();
+		int propagateConstants();
+		int invertBranches();
+		int removeJumpsToNext();
+		int threadJumps();
+		int removeUnreachable();
+		// Repeats the four control flow passes until none changes anything, adding their counts
+		int simplifyControlFlow(int counts[4]);
+		int removeDeadWrites();
+		int removeDeadStores();
+		int eliminateDeadCode();
+		// Returns the number of loads and stores rewritten as moves
+		int promoteSlots();
+		// Returns the estimated stall cycles removed
+		int scheduleBlocks();
+		int run(string vmout, string optout);
+};
+#endif
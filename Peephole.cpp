@@ -0,0 +1,320 @@
+#include "Peephole.h"
+
+// Guards against rule sets that rewrite each other forever
+#define MAX_REWRITES 64
+
+Peephole::Peephole()
+{
+	// Root of the trie
+	next.push_back(map<int, int>());
+	accept.push_back(vector<int>());
+}
+int Peephole::getId(string op)
+{
+	auto it=mnemonic_id.find(op);
+	if(it!=mnemonic_id.end())
+		return it->second;
+	int id=mnemonic_id.size();
+	mnemonic_id[op]=id;
+	return id;
+}
+vector<string> Peephole::tokens(string ins)
+{
+	// Mnemonic followed by the operands, imm(rs1) is split into imm and rs1
+	vector<string> list;
+	size_t hash=ins.find('#');
+	if(hash!=string::npos)
+		ins=ins.substr(0, hash);
+	istringstream iss(ins);
+	string op, operands;
+	if(!(iss>>op))
+		return list;
+	list.push_back(op);
+	getline(iss, operands);
+	string current;
+	for(char c : operands)
+	{
+		if(c==' ' || c=='\t' || c==')')
+			continue;
+		if(c==',' || c=='(')
+		{
+			list.push_back(current);
+			current="";
+		}
+		else
+			current+=c;
+	}
+	if(current!="")
+		list.push_back(current);
+	return list;
+}
+int Peephole::loadRules(string path)
+{
+	ifstream fin(path, ios::in);
+	if(!fin)
+	{
+		perror("Peephole rule file does not exist");
+		return 1;
+	}
+
+	string line;
+	int line_no=0;
+	while(getline(fin, line))
+	{
+		line_no++;
+		size_t hash=line.find('#');
+		if(hash!=string::npos)
+			line=line.substr(0, hash);
+		if(line.find_first_not_of(" \t\r")==string::npos)
+			continue;
+
+		size_t arrow=line.find("=>");
+		if(arrow==string::npos)
+		{
+			cout<<path<<":"<<line_no<<endl;
+			perror("Invalid peephole rule");
+			return 2;
+		}
+		PH_Rule rule;
+		rule.line=line_no;
+		string lhs=line.substr(0, arrow), rhs=line.substr(arrow+2);
+		size_t cond=rhs.find(" if ");
+		if(cond!=string::npos)
+		{
+			string list=rhs.substr(cond+4), condition;
+			rhs=rhs.substr(0, cond);
+			istringstream iss(list);
+			while(getline(iss, condition, ','))
+				rule.conditions.push_back(condition);
+		}
+
+		string ins;
+		istringstream pattern(lhs), replacement(rhs);
+		while(getline(pattern, ins, ';'))
+			if(tokens(ins).size()>0)
+				rule.pattern.push_back(ins);
+		while(getline(replacement, ins, ';'))
+			if(tokens(ins).size()>0)
+				rule.replacement.push_back(ins);
+		if(rule.pattern.empty())
+		{
+			cout<<path<<":"<<line_no<<endl;
+			perror("Empty peephole pattern");
+			return 3;
+		}
+
+		// Insert the mnemonics last to first, matching runs backwards from the newest instruction
+		int node=0;
+		for(int i=rule.pattern.size()-1;i>=0;i--)
+		{
+			int id=getId(tokens(rule.pattern[i])[0]);
+			if(next[node].find(id)==next[node].end())
+			{
+				next[node][id]=next.size();
+				next.push_back(map<int, int>());
+				accept.push_back(vector<int>());
+			}
+			node=next[node][id];
+		}
+		accept[node].push_back(rules.size());
+		rules.push_back(rule);
+	}
+	fin.close();
+	return 0;
+}
+bool Peephole::bind(string pattern, string value, unordered_map<string, string> &binding)
+{
+	if(pattern[0]!='$')
+		return pattern==value;
+	auto it=binding.find(pattern);
+	if(it==binding.end())
+	{
+		binding[pattern]=value;
+		return true;
+	}
+	return it->second==value;
+}
+string Peephole::substitute(string operand, unordered_map<string, string> &binding)
+{
+	if(operand.find('$')==string::npos)
+		return operand;
+	// Replace every variable by its value, names end at the first character that is not alphanumeric
+	string result;
+	for(size_t i=0;i<operand.length();)
+	{
+		if(operand[i]!='$')
+		{
+			result+=operand[i++];
+			continue;
+		}
+		size_t end=i+1;
+		while(end<operand.length() && (isalnum(operand[end]) || operand[end]=='_'))
+			end++;
+		auto it=binding.find(operand.substr(i, end-i));
+		if(it==binding.end())
+			return "";
+		result+=it->second;
+		i=end;
+	}
+	if(result.find_first_of("+-", 1)==string::npos)
+		return result;
+	long long value;
+	if(!evaluate(result, value))
+		return "";
+	return to_string(value);
+}
+bool Peephole::evaluate(string expr, long long &value)
+{
+	// Sum of signed integers, e.g. 12+-4 or -8
+	value=0;
+	size_t i=0;
+	if(expr=="")
+		return false;
+	while(i<expr.length())
+	{
+		int sign=1;
+		while(i<expr.length() && (expr[i]=='+' || expr[i]=='-'))
+		{
+			if(expr[i]=='-')
+				sign=-sign;
+			i++;
+		}
+		size_t end=i;
+		while(end<expr.length() && isdigit(expr[end]))
+			end++;
+		if(end==i)
+			return false;
+		value+=sign*stoll(expr.substr(i, end-i));
+		i=end;
+	}
+	return true;
+}
+bool Peephole::check(string condition, unordered_map<string, string> &binding)
+{
+	size_t first=condition.find_first_not_of(" \t\r");
+	if(first==string::npos)
+		return true;
+	condition=condition.substr(first, condition.find_last_not_of(" \t\r")-first+1);
+
+	if(condition.compare(0, 7, "fits12(")==0 && condition.back()==')')
+	{
+		long long value;
+		if(!evaluate(substitute(condition.substr(7, condition.length()-8), binding), value))
+			return false;
+		return value>=-2048 && value<=2047;
+	}
+	size_t op=condition.find("==");
+	bool equal=true;
+	if(op==string::npos)
+	{
+		op=condition.find("!=");
+		equal=false;
+	}
+	if(op==string::npos)
+		return false;
+	string a=condition.substr(0, op), b=condition.substr(op+2);
+	a.erase(remove_if(a.begin(), a.end(), ::isspace), a.end());
+	b.erase(remove_if(b.begin(), b.end(), ::isspace), b.end());
+	return (substitute(a, binding)==substitute(b, binding))==equal;
+}
+bool Peephole::match(PH_Rule &rule, vector<IR_Ins> &out, int first, vector<IR_Ins> &replacement)
+{
+	unordered_map<string, string> binding;
+	for(unsigned int i=0;i<rule.pattern.size();i++)
+	{
+		vector<string> want=tokens(rule.pattern[i]);
+		vector<string> have=tokens(out[first+i].toString());
+		if(want.size()!=have.size())
+			return false;
+		for(unsigned int j=1;j<want.size();j++)
+			if(!bind(want[j], have[j], binding))
+				return false;
+	}
+	for(string &condition : rule.conditions)
+		if(!check(condition, binding))
+			return false;
+
+	replacement.clear();
+	for(string &ins : rule.replacement)
+	{
+		// Substitute each operand, keep the separators and parse the line like program text
+		vector<string> parts=tokens(ins);
+		size_t start=ins.find(parts[0])+parts[0].length();
+		string line=parts[0]+" ", operand;
+		for(size_t j=start;j<=ins.length();j++)
+		{
+			if(j<ins.length() && ins[j]!=',' && ins[j]!='(' && ins[j]!=')')
+			{
+				if(ins[j]!=' ' && ins[j]!='\t' && ins[j]!='\r')
+					operand+=ins[j];
+				continue;
+			}
+			if(operand!="")
+			{
+				string value=substitute(operand, binding);
+				if(value=="")
+					return false;
+				line+=value;
+				operand="";
+			}
+			if(j<ins.length())
+				line+=ins[j];
+		}
+		IR_Ins ir;
+		if(parseLine(ir, line)!=0)
+			return false;
+		replacement.push_back(ir);
+	}
+	// Keep the comment of the first matched instruction
+	if(!replacement.empty())
+		replacement[0].comment=out[first].comment;
+	return true;
+}
+int Peephole::apply(vector<IR_Ins> &text)
+{
+	vector<IR_Ins> out, replacement;
+	int applied=0;
+	for(IR_Ins &entry : text)
+	{
+		out.push_back(entry);
+		for(int rewrites=0;rewrites<MAX_REWRITES;rewrites++)
+		{
+			// Walk back from the newest instruction while the trie has an edge for its mnemonic
+			int node=0, j=out.size()-1, found=-1, first=0;
+			vector<pair<int, int>> candidates;
+			while(j>=0 && out[j].isIns())
+			{
+				// Only the last instruction of a match may transfer control
+				if(j<(int)out.size()-1 && out[j].isControl())
+					break;
+				auto it=mnemonic_id.find(out[j].op);
+				if(it==mnemonic_id.end() || next[node].find(it->second)==next[node].end())
+					break;
+				node=next[node][it->second];
+				for(int r : accept[node])
+					candidates.push_back(make_pair(r, j));
+				j--;
+			}
+			// Longest pattern first, rules of the same length in file order
+			stable_sort(candidates.begin(), candidates.end(), [](const pair<int, int> &a, const pair<int, int> &b)
+			{
+				return a.second<b.second;
+			});
+			for(unsigned int c=0;c<candidates.size() && found<0;c++)
+				if(match(rules[candidates[c].first], out, candidates[c].second, replacement))
+				{
+					found=candidates[c].first;
+					first=candidates[c].second;
+				}
+			if(found<0)
+				break;
+			out.resize(first);
+			out.insert(out.end(), replacement.begin(), replacement.end());
+			applied++;
+			if(out.empty() || !out.back().isIns())
+				break;
+		}
+	}
+	text=out;
+	return applied;
+}
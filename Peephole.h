@@ -0,0 +1,46 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include "IR.h"
+#include<map>
+
+/*
+	Rule file format - one rule per line, # starts a comment
+		pattern ; pattern ... => replacement ; ... [if condition, condition ...]
+	Operands are written as in the assembly ("lw $r,$o($b)"). $name is a
+	variable that binds a register, immediate or label on first use and
+	must match the same value afterwards, other operands are literals
+	(registers as xN). Replacement operands may be sums such as $i+$j or -$i.
+	Conditions are A == B, A != B and fits12(E). An empty replacement
+	deletes the matched instructions.
+*/
+struct PH_Rule
+{
+	vector<string> pattern;
+	vector<string> replacement;
+	vector<string> conditions;
+	int line;
+};
+class Peephole
+{
+	private:
+		vector<PH_Rule> rules;
+		unordered_map<string, int> mnemonic_id;
+		// Trie over the mnemonic ids of each pattern read from its last instruction
+		vector<map<int, int>> next;
+		vector<vector<int>> accept;
+		int getId(string op);
+		vector<string> tokens(string ins);
+		bool bind(string pattern, string value, unordered_map<string, string> &binding);
+		string substitute(string operand, unordered_map<string, string> &binding);
+		bool evaluate(string expr, long long &value);
+		bool check(string condition, unordered_map<string, string> &binding);
+		bool match(PH_Rule &rule, vector<IR_Ins> &out, int first, vector<IR_Ins> &replacement);
+
+	public:
+		Peephole();
+		int loadRules(string path);
+		// Single scan over text, returns the number of rules applied
+		int apply(vector<IR_Ins> &text);
+};
+#endif
@@ -0,0 +1,133 @@
+#include "RVC.h"
+
+bool RVC::isCompact(int reg)
+{
+	return reg>=8 && reg<16;
+}
+bool RVC::fits(int value, int bits)
+{
+	// Signed immediate of the given width
+	return value>=-(1<<(bits-1)) && value<(1<<(bits-1));
+}
+bool RVC::compressible(IR_Ins &ir, int offset)
+{
+	if(!ir.isIns())
+		return false;
+	string op=ir.op;
+	if(op=="lw" || op=="sw")
+	{
+		int reg=(op=="lw")?ir.rd:ir.rs2;
+		if(ir.rs1==2)
+			// c.lwsp / c.swsp
+			return ir.imm>=0 && ir.imm<256 && ir.imm%4==0 && (op=="sw" || reg!=0);
+		// c.lw / c.sw - the offset is unsigned so negative frame offsets stay 32 bit
+		return isCompact(reg) && isCompact(ir.rs1) && ir.imm>=0 && ir.imm<128 && ir.imm%4==0;
+	}
+	if(op=="addi")
+	{
+		if(ir.rd==0)
+			return false;
+		// c.li
+		if(ir.rs1==0)
+			return fits(ir.imm, 6);
+		// c.mv
+		if(ir.imm==0)
+			return true;
+		// c.addi
+		return ir.rs1==ir.rd && fits(ir.imm, 6);
+	}
+	if(op=="lui")
+	{
+		// c.lui - nonzero 6 bit signed upper immediate
+		int imm=ir.imm&1048575;
+		return ir.rd!=0 && ir.rd!=2 && ((imm>=1 && imm<32) || imm>=1048544);
+	}
+	if(op=="add")
+		return ir.rd!=0 && ((ir.rs1==ir.rd && ir.rs2!=0) || (ir.rs2==ir.rd && ir.rs1!=0));
+	if(op=="sub")
+		return isCompact(ir.rd) && ir.rs1==ir.rd && isCompact(ir.rs2);
+	if(op=="xor" || op=="or" || op=="and")
+		return isCompact(ir.rd) && ((ir.rs1==ir.rd && isCompact(ir.rs2)) || (ir.rs2==ir.rd && isCompact(ir.rs1)));
+	if(op=="jal")
+		return (ir.rd==0 || ir.rd==1) && offset%2==0 && fits(offset, 12);
+	if(op=="jalr")
+		return (ir.rd==0 || ir.rd==1) && ir.rs1!=0 && ir.imm==0;
+	if(op=="beq" || op=="bne")
+		return ((isCompact(ir.rs1) && ir.rs2==0) || (ir.rs1==0 && isCompact(ir.rs2))) && offset%2==0 && fits(offset, 9);
+	return false;
+}
+int RVC::encode(IR_Ins &ir, int offset)
+{
+	string op=ir.op;
+	int ins=0;
+	if(op=="lw" || op=="sw")
+	{
+		int reg=(op=="lw")?ir.rd:ir.rs2;
+		int imm=ir.imm;
+		if(ir.rs1==2)
+		{
+			if(op=="lw")
+				// c.lwsp : 010 imm[5] rd imm[4:2|7:6] 10
+				ins=(2<<13)|(((imm>>5)&1)<<12)|(reg<<7)|(((imm>>2)&7)<<4)|(((imm>>6)&3)<<2)|2;
+			else
+				// c.swsp : 110 imm[5:2|7:6] rs2 10
+				ins=(6<<13)|(((imm>>2)&15)<<9)|(((imm>>6)&3)<<7)|(reg<<2)|2;
+			return ins;
+		}
+		// c.lw / c.sw : funct3 imm[5:3] rs1' imm[2|6] rd'/rs2' 00
+		ins=((op=="lw"?2:6)<<13)|(((imm>>3)&7)<<10)|((ir.rs1-8)<<7)|(((imm>>2)&1)<<6)|(((imm>>6)&1)<<5)|((reg-8)<<2);
+		return ins;
+	}
+	if(op=="addi")
+	{
+		int imm=ir.imm&63;
+		if(ir.rs1==0)
+			// c.li : 010 imm[5] rd imm[4:0] 01
+			return (2<<13)|((imm>>5)<<12)|(ir.rd<<7)|((imm&31)<<2)|1;
+		if(ir.imm==0)
+			// c.mv : 1000 rd rs2 10
+			return (8<<12)|(ir.rd<<7)|(ir.rs1<<2)|2;
+		// c.addi : 000 imm[5] rd imm[4:0] 01
+		return ((imm>>5)<<12)|(ir.rd<<7)|((imm&31)<<2)|1;
+	}
+	if(op=="lui")
+	{
+		// c.lui : 011 nzimm[17] rd nzimm[16:12] 01
+		int imm=ir.imm&63;
+		return (3<<13)|((imm>>5)<<12)|(ir.rd<<7)|((imm&31)<<2)|1;
+	}
+	if(op=="add")
+	{
+		// c.add : 1001 rd rs2 10
+		int rs2=(ir.rs1==ir.rd)?ir.rs2:ir.rs1;
+		return (9<<12)|(ir.rd<<7)|(rs2<<2)|2;
+	}
+	if(op=="sub" || op=="xor" || op=="or" || op=="and")
+	{
+		// c.sub / c.xor / c.or / c.and : 100011 rd' funct2 rs2' 01
+		int funct2=(op=="sub")?0:(op=="xor")?1:(op=="or")?2:3;
+		int rs2=(ir.rs1==ir.rd)?ir.rs2:ir.rs1;
+		return (35<<10)|((ir.rd-8)<<7)|(funct2<<5)|((rs2-8)<<2)|1;
+	}
+	if(op=="jal")
+	{
+		// c.j / c.jal : funct3 imm[11|4|9:8|10|6|7|3:1|5] 01
+		int o=offset;
+		ins=((ir.rd==0?5:1)<<13)|(((o>>11)&1)<<12)|(((o>>4)&1)<<11)|(((o>>8)&3)<<9)|(((o>>10)&1)<<8);
+		ins|=(((o>>6)&1)<<7)|(((o>>7)&1)<<6)|(((o>>1)&7)<<3)|(((o>>5)&1)<<2)|1;
+		return ins;
+	}
+	if(op=="jalr")
+		// c.jr / c.jalr : 100x rs1 00000 10
+		return ((ir.rd==0?8:9)<<12)|(ir.rs1<<7)|2;
+	if(op=="beq" || op=="bne")
+	{
+		// c.beqz / c.bnez : funct3 imm[8|4:3] rs1' imm[7:6|2:1|5] 01
+		int o=offset;
+		int rs1=(ir.rs2==0)?ir.rs1:ir.rs2;
+		ins=((op=="beq"?6:7)<<13)|(((o>>8)&1)<<12)|(((o>>3)&3)<<10)|((rs1-8)<<7);
+		ins|=(((o>>6)&3)<<5)|(((o>>1)&3)<<3)|(((o>>5)&1)<<2)|1;
+		return ins;
+	}
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef RVC_H
+#define RVC_H
+
+#include "IR.h"
+
+/*
+	16 bit RVC forms of the supported instructions.
+	Offsets of B and J forms follow the assembler's convention of
+	being relative to the next instruction i.e. target - (address + 2).
+*/
+class RVC
+{
+	private:
+		// x8 to x15 have 3 bit encodings
+		bool isCompact(int reg);
+		bool fits(int value, int bits);
+
+	public:
+		// True when ir has a 16 bit form, offset is only used for B and J
+		bool compressible(IR_Ins &ir, int offset);
+		// 16 bit encoding of a compressible instruction
+		int encode(IR_Ins &ir, int offset);
+};
+#endif
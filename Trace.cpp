@@ -0,0 +1,112 @@
+#include "Trace.h"
+#include<fstream>
+#include<mutex>
+#include<memory>
+#include<cstdio>
+#include<unistd.h>
+
+static bool tracing=false;
+static chrono::steady_clock::time_point epoch;
+// Buffers outlive their threads, the mutex only guards this list
+static mutex buffers_lock;
+static vector<unique_ptr<TR_Buffer>> buffers;
+static thread_local TR_Buffer* buffer=NULL;
+
+void setTracing(bool enabled)
+{
+	tracing=enabled;
+	epoch=chrono::steady_clock::now();
+}
+bool isTracing()
+{
+	return tracing;
+}
+static void record(string &name, string &file, char phase)
+{
+	double ts=chrono::duration<double, micro>(chrono::steady_clock::now()-epoch).count();
+	if(buffer==NULL)
+	{
+		lock_guard<mutex> guard(buffers_lock);
+		buffers.push_back(unique_ptr<TR_Buffer>(new TR_Buffer()));
+		buffer=buffers.back().get();
+		buffer->tid=buffers.size();
+	}
+	TR_Event event;
+	event.name=name;
+	event.file=file;
+	event.phase=phase;
+	event.ts=ts;
+	buffer->events.push_back(event);
+}
+void traceBegin(string name, string file)
+{
+	if(tracing)
+		record(name, file, 'B');
+}
+void traceEnd(string name, string file)
+{
+	if(tracing)
+		record(name, file, 'E');
+}
+
+static string escape(string s)
+{
+	string out;
+	for(char c : s)
+	{
+		if(c=='"' || c=='\\')
+			out+='\\';
+		out+=c;
+	}
+	return out;
+}
+int writeTrace(string path)
+{
+	ofstream fout(path, ios::out);
+	if(!fout)
+	{
+		perror("Unable to create trace output");
+		return 1;
+	}
+	lock_guard<mutex> guard(buffers_lock);
+	int pid=getpid();
+	bool first=true;
+	fout<<"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+	fout.precision(3);
+	fout<<fixed;
+	for(unique_ptr<TR_Buffer> &b : buffers)
+	{
+		// Names the thread row in the viewer, the first thread to record is main
+		fout<<(first?"\n":",\n")<<"  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": "<<pid<<", \"tid\": "<<b->tid
+			<<", \"args\": {\"name\": \""<<(b->tid==1?"main":"worker "+to_string(b->tid-1))<<"\"}}";
+		first=false;
+		for(TR_Event &e : b->events)
+		{
+			fout<<",\n  {\"name\": \""<<escape(e.name)<<"\", \"cat\": \"assembler\", \"ph\": \""<<e.phase
+				<<"\", \"ts\": "<<e.ts<<", \"pid\": "<<pid<<", \"tid\": "<<b->tid;
+			if(e.file!="")
+				fout<<", \"args\": {\"file\": \""<<escape(e.file)<<"\"}";
+			fout<<"}";
+		}
+	}
+	fout<<"\n]}\n";
+	return 0;
+}
+
+TR_Scope::TR_Scope(string name, string file)
+{
+	this->name=name;
+	this->file=file;
+	open=true;
+	traceBegin(name, file);
+}
+TR_Scope::~TR_Scope()
+{
+	end();
+}
+void TR_Scope::end()
+{
+	if(open)
+		traceEnd(name, file);
+	open=false;
+}
@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include<string>
+#include<vector>
+#include<chrono>
+using namespace std;
+
+/*
+	Chrome trace events (chrome://tracing, Perfetto) for --trace FILE.
+	Every thread records into its own buffer, which is only locked once
+	when the thread records its first event, so tracing adds no contention
+	between threads. writeTrace merges the buffers into one file.
+*/
+struct TR_Event
+{
+	string name;
+	string file;
+	// 'B' begin or 'E' end
+	char phase;
+	// Microseconds since tracing was enabled
+	double ts;
+};
+struct TR_Buffer
+{
+	int tid;
+	vector<TR_Event> events;
+};
+void setTracing(bool enabled);
+bool isTracing();
+void traceBegin(string name, string file="");
+void traceEnd(string name, string file="");
+int writeTrace(string path);
+
+// Begin and end events around a scope, so that early returns stay balanced
+class TR_Scope
+{
+	string name;
+	string file;
+	bool open;
+	public:
+		TR_Scope(string name, string file="");
+		~TR_Scope();
+		// Ends the span before the scope does, the destructor then does nothing
+		void end();
+};
+#endif
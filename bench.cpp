@@ -0,0 +1,188 @@
+#include "Optimizer.h"
+#include<chrono>
+#include<cmath>
+
+/*
+	Assembler benchmark
+		./bench.out [--repeat N] [--optimize] [--label NAME] [--json FILE] file.asm ...
+	Every file is assembled N times. Each phase reports the median, min,
+	mean and standard deviation of its wall time, throughput at the median
+	and the peak RSS reached during the phase.
+*/
+
+struct Phase
+{
+	string name;
+	vector<double> seconds;
+	long peak_rss_kb;
+	Phase(string name);
+};
+Phase::Phase(string name)
+{
+	this->name=name;
+	peak_rss_kb=0;
+}
+
+// Linux lets the peak RSS be reset so each phase gets its own, elsewhere it is the process peak
+void resetPeakRSS()
+{
+	ofstream fout("/proc/self/clear_refs", ios::out);
+	if(fout)
+		fout<<"5";
+}
+
+// Runs one phase, adding its time and peak RSS to phase, returns its status
+template<typename F> int measure(Phase &phase, F run)
+{
+	resetPeakRSS();
+	auto start=chrono::steady_clock::now();
+	int code=run();
+	auto end=chrono::steady_clock::now();
+	phase.seconds.push_back(chrono::duration<double>(end-start).count());
+	phase.peak_rss_kb=max(phase.peak_rss_kb, peakRSS());
+	return code;
+}
+
+int countLines(string path, long &bytes)
+{
+	ifstream fin(path, ios::in);
+	string line;
+	int lines=0;
+	bytes=0;
+	while(getline(fin, line))
+	{
+		lines++;
+		bytes+=line.length()+1;
+	}
+	return lines;
+}
+
+void writePhase(ostream &out, Phase &phase, int lines, long bytes, int instructions)
+{
+	vector<double> sorted=phase.seconds;
+	sort(sorted.begin(), sorted.end());
+	int n=sorted.size();
+	double median=n%2?sorted[n/2]:(sorted[n/2-1]+sorted[n/2])/2;
+	double mean=0, variance=0;
+	for(double s : sorted)
+		mean+=s/n;
+	for(double s : sorted)
+		variance+=(s-mean)*(s-mean)/n;
+	// Guards against a zero time on tiny inputs
+	double t=max(median, 1e-9);
+
+	out<<"        {\"name\": \""<<phase.name<<"\", \"median_s\": "<<median<<", \"min_s\": "<<sorted[0]
+		<<", \"mean_s\": "<<mean<<", \"stddev_s\": "<<sqrt(variance)
+		<<", \"lines_per_s\": "<<lines/t<<", \"mb_per_s\": "<<bytes/t/1e6
+		<<", \"instructions_per_s\": "<<instructions/t<<", \"peak_rss_kb\": "<<phase.peak_rss_kb<<"}";
+}
+
+int main(int argc, char* argv[])
+{
+	int repeat=5;
+	bool optimize=false;
+	string json="", label="";
+	vector<string> files;
+	for(int i=1;i<argc;i++)
+	{
+		string arg=argv[i];
+		if(arg=="--repeat" && i+1<argc)
+			repeat=max(1, stoi(argv[++i]));
+		else if(arg=="--optimize")
+			optimize=true;
+		else if(arg=="--label" && i+1<argc)
+			label=argv[++i];
+		else if(arg=="--json" && i+1<argc)
+			json=argv[++i];
+		else
+			files.push_back(arg);
+	}
+	if(files.empty())
+	{
+		perror("No input files");
+		return 1;
+	}
+
+	ofstream fout;
+	if(json!="")
+	{
+		fout.open(json, ios::out);
+		if(!fout)
+		{
+			perror("Unable to create benchmark output");
+			return 1;
+		}
+	}
+	ostream &out=json!=""?fout:cout;
+	// The passes print progress, keep it out of the results
+	streambuf* console=cout.rdbuf();
+	ostringstream discard;
+
+	// label names the build, e.g. the commit, so that result files can be compared
+	out<<"{\n  \"label\": \""<<label<<"\",\n  \"repeat\": "<<repeat<<",\n  \"results\": [";
+	for(unsigned int f=0;f<files.size();f++)
+	{
+		long bytes;
+		int lines=countLines(files[f], bytes);
+		vector<Phase> phases;
+		if(optimize)
+			phases.push_back(Phase("optimize"));
+		phases.push_back(Phase("first_pass"));
+		phases.push_back(Phase("second_pass"));
+		phases.push_back(Phase("total"));
+
+		int code=0;
+		cout.rdbuf(discard.rdbuf());
+		for(int r=0;r<repeat && code==0;r++)
+		{
+			string input=files[f];
+			auto start=chrono::steady_clock::now();
+			int p=0;
+			if(optimize)
+			{
+				code=measure(phases[p++], [&]()
+				{
+					Optimizer O;
+					return O.run(files[f], "benchopt.asm");
+				});
+				input="benchopt.asm";
+			}
+			Assembler A;
+			if(code==0)
+				code=measure(phases[p++], [&]()
+				{
+					return A.firstPass(input);
+				});
+			if(code==0)
+				code=measure(phases[p++], [&]()
+				{
+					return A.secondPass(input, "benchout.o");
+				});
+			phases[p].seconds.push_back(chrono::duration<double>(chrono::steady_clock::now()-start).count());
+			phases[p].peak_rss_kb=peakRSS();
+			discard.str("");
+		}
+		cout.rdbuf(console);
+		if(code!=0)
+		{
+			cout<<files[f]<<endl;
+			perror("Assembly failed");
+			return 2;
+		}
+
+		long out_bytes;
+		int instructions=countLines("benchout.o", out_bytes);
+		out<<(f==0?"\n":",\n")<<"    {\"file\": \""<<files[f]<<"\", \"lines\": "<<lines<<", \"bytes\": "<<bytes
+			<<", \"instructions\": "<<instructions<<",\n      \"phases\": [";
+		for(unsigned int p=0;p<phases.size();p++)
+		{
+			out<<(p==0?"\n":",\n");
+			writePhase(out, phases[p], lines, bytes, instructions);
+		}
+		out<<"\n      ]}";
+	}
+	out<<"\n  ]\n}\n";
+	remove("benchout.o");
+	remove("benchopt.asm");
+	return 0;
+}
@@ -0,0 +1,200 @@
+"""Seeded generator of large assembly inputs shaped like the compiler's output.
+
+    python generate_program.py --instructions 100000 --seed 1 -o big.asm
+
+The same seed and options always give the same file. Statements follow the
+compiler's patterns: constants built with lui/addi, x8-relative slot loads and
+stores, binary operations, x2 stack pushes and pops, if/else on beq/blt with
+jal or beq x0,x0 jumps, bounded counting loops and spill blocks.
+"""
+import argparse
+import random
+import sys
+
+TEMPS = ["x5", "x6", "x7", "x28", "x29", "x30", "x31"]
+SPILL_START = "# ---- start of spill ----"
+SPILL_END = "# ---- end of spill ----"
+
+
+class Generator:
+    def __init__(self, rng, slots, label_density, spill_rate):
+        self.rng = rng
+        # x8-relative word slots, a loop body never writes its counter slot
+        self.slots = [-4 * (i + 1) for i in range(slots)]
+        self.label_density = label_density
+        self.spill_rate = spill_rate
+        self.labels = 0
+        self.count = 0
+        self.lines = []
+
+    def ins(self, line):
+        self.lines.append("    " + line)
+        self.count += 1
+
+    def label(self):
+        self.labels += 1
+        return f"L{self.labels - 1}"
+
+    def place(self, label):
+        self.lines.append(f"{label}:")
+
+    def slot(self, exclude=()):
+        while True:
+            s = self.rng.choice(self.slots)
+            if s not in exclude:
+                return s
+
+    def constant(self, rd):
+        # Same shape as the compiler: lui then a chain of addi
+        value = self.rng.randint(0, 1 << 20)
+        self.ins(f"lui {rd},{value >> 12}")
+        low = value & 0xFFF
+        while low > 0:
+            step = min(low, self.rng.choice([1, 10, 181, 1361, 2047]))
+            self.ins(f"addi {rd},{rd},{step}")
+            low -= step
+
+    def assign(self, exclude):
+        rd = self.rng.choice(TEMPS)
+        self.constant(rd)
+        self.ins(f"sw {rd},{self.slot(exclude)}(x8)")
+
+    def binary(self, exclude):
+        a, b, c = self.rng.sample(TEMPS, 3)
+        op = self.rng.choice(["add", "add", "add", "sub", "xor", "or", "and"])
+        self.ins(f"lw {a},{self.slot()}(x8)")
+        self.ins(f"lw {b},{self.slot()}(x8)")
+        self.ins(f"{op} {c},{a},{b}")
+        self.ins(f"sw {c},{self.slot(exclude)}(x8)")
+
+    def stack(self):
+        rd = self.rng.choice(TEMPS)
+        self.ins(f"sw {rd},0(x2)")
+        self.ins("addi x2,x2,-4")
+        self.ins("addi x2,x2,4")
+        self.ins(f"lw {rd},0(x2)")
+
+    def spill(self, exclude):
+        self.lines.append(SPILL_START)
+        for rd in self.rng.sample(TEMPS, self.rng.randint(2, len(TEMPS))):
+            self.ins(f"sw {rd},{self.slot(exclude)}(x8)")
+        self.lines.append(SPILL_END)
+
+    def simple(self, exclude):
+        kind = self.rng.random()
+        if kind < 0.45:
+            self.assign(exclude)
+        elif kind < 0.85:
+            self.binary(exclude)
+        else:
+            self.stack()
+        if self.rng.random() < self.spill_rate:
+            self.spill(exclude)
+
+    def branch(self, exclude):
+        # if (a op b) { then } else { other }
+        a, b = self.rng.sample(TEMPS, 2)
+        then, other, done = self.label(), self.label(), self.label()
+        self.ins(f"lw {a},{self.slot()}(x8)")
+        self.ins(f"lw {b},{self.slot()}(x8)")
+        self.ins(f"{self.rng.choice(['beq', 'bne', 'blt', 'bge'])} {a},{b},{then}")
+        self.ins(f"beq x0,x0,{other}")
+        self.place(then)
+        for _ in range(self.rng.randint(1, 4)):
+            self.simple(exclude)
+        self.ins(f"jal x30,{done}")
+        self.place(other)
+        for _ in range(self.rng.randint(1, 4)):
+            self.simple(exclude)
+        self.place(done)
+
+    def loop(self, exclude):
+        # for (i = 0; i < n; i++) with the counter in its own slot
+        counter = self.slot(exclude)
+        exclude = exclude + (counter,)
+        head, body, done = self.label(), self.label(), self.label()
+        self.ins("addi x29,x0,0")
+        self.ins(f"sw x29,{counter}(x8)")
+        self.place(head)
+        self.ins(f"lw x29,{counter}(x8)")
+        self.ins(f"addi x30,x0,{self.rng.randint(1, 4)}")
+        self.ins(f"blt x29,x30,{body}")
+        self.ins(f"beq x0,x0,{done}")
+        self.place(body)
+        for _ in range(self.rng.randint(1, 6)):
+            if self.rng.random() < self.label_density / 2:
+                self.branch(exclude)
+            else:
+                self.simple(exclude)
+        self.ins(f"lw x29,{counter}(x8)")
+        self.ins("addi x29,x29,1")
+        self.ins(f"sw x29,{counter}(x8)")
+        self.ins(f"beq x0,x0,{head}")
+        self.place(done)
+
+    def statement(self):
+        kind = self.rng.random()
+        if kind < self.label_density / 2:
+            self.branch(())
+        elif kind < self.label_density:
+            self.loop(())
+        else:
+            self.simple(())
+
+
+def data_section(rng, entries):
+    lines = [".section", ".data"]
+    words = ["Hello", "matrix", "value", "result", "sum", "of", "is", "the"]
+    for i in range(entries):
+        lines.append(f"__main__data{i}:")
+        if rng.random() < 0.7:
+            text = " ".join(rng.choice(words) for _ in range(rng.randint(1, 6)))
+            lines.append(f'\t.asciz "{text}\\n"')
+        else:
+            lines.append(f"\t.word {rng.randint(0, 1 << 16)}")
+    return lines
+
+
+def generate(out, instructions, seed, data, slots, label_density, spill_rate):
+    rng = random.Random(seed)
+    lines = data_section(rng, data) + [".section", ".text", "main:"]
+    out.write("\n".join(lines) + "\n")
+
+    gen = Generator(rng, slots, label_density, spill_rate)
+    while gen.count < instructions:
+        gen.statement()
+        # Stream the text so that very large inputs never sit in memory
+        if len(gen.lines) >= 65536:
+            out.write("\n".join(gen.lines) + "\n")
+            gen.lines = []
+    gen.lines.append("end:")
+    out.write("\n".join(gen.lines) + "\n")
+    return gen.count
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-n", "--instructions", type=int, default=1000,
+                        help="minimum number of instructions (default 1000)")
+    parser.add_argument("-s", "--seed", type=int, default=0)
+    parser.add_argument("-o", "--output", default="-", help="output file, - for stdout")
+    parser.add_argument("--data", type=int, default=8, help="data section entries")
+    parser.add_argument("--slots", type=int, default=64, help="x8-relative slots in use (at most 512)")
+    parser.add_argument("--label-density", type=float, default=0.1,
+                        help="fraction of statements that are branches or loops")
+    parser.add_argument("--spill-rate", type=float, default=0.05,
+                        help="chance of a spill block after a simple statement")
+    args = parser.parse_args()
+    if not 2 <= args.slots <= 512:
+        parser.error("--slots must be between 2 and 512")
+
+    out = sys.stdout if args.output == "-" else open(args.output, "w")
+    count = generate(out, args.instructions, args.seed, args.data, args.slots,
+                     args.label_density, args.spill_rate)
+    if out is not sys.stdout:
+        out.close()
+    print(f"{count} instructions", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
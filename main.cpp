@@ -0,0 +1,145 @@
+#include "Optimizer.h"
+
+// Whole argument as a decimal integer, false when it is not one
+bool parseInt(string text, int &value)
+{
+	try
+	{
+		size_t end;
+		value=stoi(text, &end);
+		return end==text.length();
+	}
+	catch(const exception& e)
+	{
+		return false;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	string vmout="vmout.asm";
+	string asmout="asmout.o";
+	string optout="optout.asm";
+	string rules="";
+	string report="";
+	string trace="";
+	bool optimize=false, compress=false, promote=false, stats=false, counters=false, stream=false;
+	// Alignment in bytes of back-edge targets, 0 leaves them unaligned
+	int loop_align=0;
+	LatencyModel latency;
+
+	for(int i=1;i<argc;i++)
+	{
+		string arg=argv[i];
+		if(arg=="-O")
+			optimize=true;
+		else if(arg=="-C")
+			compress=true;
+		else if((arg=="--load-latency" || arg=="--alu-latency") && i+1<argc)
+		{
+			int cycles;
+			if(!parseInt(argv[++i], cycles) || cycles<1)
+			{
+				perror("Latency must be a whole number of cycles, at least 1");
+				return 1;
+			}
+			if(arg=="--load-latency")
+				latency.load=cycles;
+			else
+				latency.alu=cycles;
+		}
+		else if(arg=="--stats")
+			stats=true;
+		else if(arg=="--stream")
+			stream=true;
+		else if(arg=="--counters")
+			stats=counters=true;
+		else if(arg=="--promote-slots")
+			promote=true;
+		else if(arg=="--trace" && i+1<argc)
+			trace=argv[++i];
+		else if(arg=="--report" && i+1<argc)
+			report=argv[++i];
+		else if(arg=="--rules" && i+1<argc)
+			rules=argv[++i];
+		else if(arg=="--align-loops" && i+1<argc)
+		{
+			if(!parseInt(argv[++i], loop_align) || loop_align<2 || (loop_align&(loop_align-1))!=0)
+			{
+				perror("Loop alignment must be a power of two");
+				return 1;
+			}
+		}
+		else
+		{
+			cout<<arg<<endl;
+			perror("Unknown option");
+			return 1;
+		}
+	}
+
+	// Options of the optimizer would otherwise be ignored without a word
+	if(!optimize && (rules!="" || promote || report!=""))
+	{
+		perror("--rules, --promote-slots and --report need -O");
+		return 1;
+	}
+
+	// Both keep every instruction in memory
+	if(stream && (optimize || compress))
+	{
+		perror("--stream cannot be combined with -O or -C");
+		return 1;
+	}
+
+	cout<<"------STARTED\n";
+	setTracing(trace!="");
+
+	if(optimize)
+	{
+		// Optimized program is written to optout and assembled in place of vmout
+		Optimizer O;
+		O.setLatencyModel(latency);
+		O.setPeepholeRules(rules);
+		O.setPromoteSlots(promote);
+		O.setReport(report);
+		if(O.run(vmout, optout)!=0)
+		{
+			perror("Optimization failed");
+			return 1;
+		}
+		vmout=optout;
+	}
+
+	Assembler A;
+	A.setCompressed(compress);
+	A.setLoopAlign(loop_align);
+	A.setStats(stats);
+	A.setCounters(counters);
+	A.setStreaming(stream);
+	int flag=A.firstPass(vmout);
+	if(flag==0)
+	{
+		A.printST();
+		cout<<"\nFIRST PASS COMPLETE\n\nSECOND PASS STARTED...\n";
+		flag=A.secondPass(vmout, asmout);
+	}
+
+	if(trace!="" && writeTrace(trace)!=0)
+		return 1;
+
+	if(flag==0)
+	{
+		cout<<"\nSECOND PASS COMPLETE\n";
+		if(stats)
+			A.printStats();
+	}
+	else
+	{
+		cout<<flag<<endl;
+		perror("Invalid Code");
+		return 1;
+	}
+
+	cout<<"\nENDED------\n";
+}
\ No newline at end of file
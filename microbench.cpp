@@ -0,0 +1,136 @@
+#include "Assembler.h"
+
+/*
+	Microbenchmarks of the per-instruction hot functions
+		./microbench.out [--time SECONDS] [--json FILE]
+	Each case runs until it has taken at least --time seconds (default
+	0.2) and reports ns/op and heap allocations/op, counted by the
+	Alloc.cpp hooks that make microbench builds with -DCOUNT_ALLOCS.
+*/
+
+struct Result
+{
+	string name;
+	double ns_per_op;
+	double allocs_per_op;
+};
+// Keeps the results of the measured calls alive
+static volatile long sink=0;
+
+template<typename F> Result measure(string name, double min_time, F run)
+{
+	// Warm up, then double the iterations until the run is long enough
+	run();
+	long iterations=1;
+	while(true)
+	{
+		long start_allocs=alloc_counters.allocations;
+		auto start=chrono::steady_clock::now();
+		for(long i=0;i<iterations;i++)
+			run();
+		double seconds=chrono::duration<double>(chrono::steady_clock::now()-start).count();
+		if(seconds>=min_time)
+		{
+			Result r;
+			r.name=name;
+			r.ns_per_op=seconds*1e9/iterations;
+			r.allocs_per_op=(double)(alloc_counters.allocations-start_allocs)/iterations;
+			return r;
+		}
+		iterations*=2;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	double min_time=0.2;
+	string json="";
+	for(int i=1;i<argc;i++)
+	{
+		string arg=argv[i];
+		if(arg=="--time" && i+1<argc)
+			min_time=stod(argv[++i]);
+		else if(arg=="--json" && i+1<argc)
+			json=argv[++i];
+		else
+		{
+			cout<<arg<<endl;
+			perror("Unknown option");
+			return 1;
+		}
+	}
+
+	REGISTERS* registers=Map::getInstance()->getRegisters();
+	OPERATIONS* operations=Map::getInstance()->getOperations();
+	ARENA arena;
+	SymbolTable symbol_table(0, hash<string>(), equal_to<string>(), &arena);
+	symbol_table["L1"]=ST_Entry(0, 10);
+	registers->setSymbolTable(symbol_table);
+
+	// Operand strings as the compiler writes them, one per format
+	struct Case
+	{
+		string op;
+		unsigned char type;
+		string operands;
+	};
+	vector<Case> cases={
+		{"add", 'R', "x5,x6,x7"},
+		{"addi", 'I', "x5,x6,-12"},
+		{"lw", 'I', "x5,-4(x8)"},
+		{"sw", 'S', "x5,-4(x8)"},
+		{"blt", 'B', "x6,x30,L1"},
+		{"lui", 'U', "x5,0x1f"},
+		{"jal", 'J', "x1,L1"},
+	};
+
+	vector<Result> results;
+	for(Case &c : cases)
+	{
+		string suffix=" "+c.op+" "+c.operands;
+		results.push_back(measure("extractRegisters"+suffix, min_time, [&]()
+		{
+			sink+=registers->extractRegisters(c.operands, c.type).size();
+		}));
+		if(c.type=='I' || c.type=='S' || c.type=='U')
+			results.push_back(measure("extractImmediate"+suffix, min_time, [&]()
+			{
+				vector<int> regs;
+				sink+=registers->extractImmediate(regs, c.operands, c.type, 0);
+			}));
+		if(c.type=='B' || c.type=='J')
+			results.push_back(measure("extractLabel"+suffix, min_time, [&]()
+			{
+				vector<int> regs;
+				sink+=registers->extractLabel(regs, c.operands);
+			}));
+		results.push_back(measure("setIns"+suffix, min_time, [&]()
+		{
+			int ins=0;
+			sink+=operations->setIns(ins, c.op);
+		}));
+		results.push_back(measure("setRegCode"+suffix, min_time, [&]()
+		{
+			int ins=0;
+			sink+=registers->setRegCode(ins, c.operands, c.type, 5);
+		}));
+	}
+
+	for(Result &r : results)
+		printf("%-40s %12.1f ns/op %8.2f allocs/op\n", r.name.c_str(), r.ns_per_op, r.allocs_per_op);
+	if(json!="")
+	{
+		ofstream fout(json, ios::out);
+		if(!fout)
+		{
+			perror("Unable to create benchmark output");
+			return 1;
+		}
+		fout<<"{\n  \"results\": [";
+		for(unsigned int i=0;i<results.size();i++)
+			fout<<(i==0?"\n":",\n")<<"    {\"name\": \""<<results[i].name<<"\", \"ns_per_op\": "<<results[i].ns_per_op
+				<<", \"allocs_per_op\": "<<results[i].allocs_per_op<<"}";
+		fout<<"\n  ]\n}\n";
+	}
+	return 0;
+}
@@ -0,0 +1,109 @@
+"""Performance regression gate for the assembler.
+
+    python perf_gate.py              run the corpus and compare with the baseline
+    python perf_gate.py --update     run the corpus and store it as the new baseline
+
+Runs bench.out over the standard corpus and compares every input and phase
+with perf/baseline.json. Times are compared on the fastest run (min_s), which
+moves far less between runs than the median. A phase regresses when that time
+grows by more than --time-threshold of the phase plus --min-delta seconds, and
+by more than --sigma times the combined standard deviation of both runs.
+Phases shorter than --min-phase seconds in the baseline are only reported, a
+few milliseconds of scheduling noise is a large fraction of them. Peak RSS
+regresses when it grows by more than --memory-threshold. Exits with 1 on any
+regression.
+"""
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+
+BASELINE = os.path.join("perf", "baseline.json")
+CORPUS = ["test.asm", "test1.asm", "test2.asm", "test3.asm", "test4.asm",
+          "test5.asm", "test6.asm", "perf_10k.asm"]
+
+
+def generate_inputs():
+    if not os.path.exists("perf_10k.asm"):
+        subprocess.run([sys.executable, "generate_program.py", "-n", "10000", "-s", "1",
+                        "-o", "perf_10k.asm"], check=True)
+
+
+def run_bench(repeat, output):
+    subprocess.run(["./bench.out", "--repeat", str(repeat), "--json", output] + CORPUS,
+                   check=True)
+    with open(output) as fp:
+        return json.load(fp)
+
+
+def index(results):
+    return {(r["file"], p["name"]): p for r in results["results"] for p in r["phases"]}
+
+
+def compare(baseline, current, args):
+    base = index(baseline)
+    failures = []
+    for key, cur in sorted(index(current).items()):
+        old = base.get(key)
+        if old is None:
+            print(f"{key[0]:16} {key[1]:12} new, no baseline")
+            continue
+        growth = cur["min_s"] / max(old["min_s"], 1e-9) - 1
+        # The allowed growth scales with the phase, min_delta keeps short ones from failing on a few ms
+        floor = args.time_threshold * old["min_s"] + args.min_delta
+        noise = args.sigma * math.sqrt(old["stddev_s"] ** 2 + cur["stddev_s"] ** 2)
+        short = old["min_s"] < args.min_phase
+        slower = not short and cur["min_s"] - old["min_s"] > max(floor, noise)
+        memory = cur["peak_rss_kb"] / max(old["peak_rss_kb"], 1) - 1
+        bigger = memory > args.memory_threshold
+        status = "REGRESSED" if slower or bigger else "ok"
+        if short and not bigger:
+            status = "report only"
+        print(f"{key[0]:16} {key[1]:12} time {growth:+7.1%}  rss {memory:+7.1%}  {status}")
+        if slower or bigger:
+            failures.append(key)
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--update", action="store_true", help="store the results as the baseline")
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--time-threshold", type=float, default=0.10,
+                        help="allowed relative growth of the fastest run (default 0.10)")
+    parser.add_argument("--memory-threshold", type=float, default=0.10,
+                        help="allowed relative growth of the peak RSS (default 0.10)")
+    parser.add_argument("--sigma", type=float, default=3.0,
+                        help="growth must also exceed this many standard deviations")
+    parser.add_argument("--min-delta", type=float, default=0.005,
+                        help="seconds allowed on top of --time-threshold (default 0.005)")
+    parser.add_argument("--min-phase", type=float, default=0.05,
+                        help="shorter baseline phases are reported but never fail (default 0.05)")
+    args = parser.parse_args()
+
+    generate_inputs()
+    current = run_bench(args.repeat, "perf_current.json")
+    if args.update:
+        os.makedirs(os.path.dirname(BASELINE), exist_ok=True)
+        with open(BASELINE, "w") as fp:
+            json.dump(current, fp, indent=2)
+        print(f"baseline written to {BASELINE}")
+        return 0
+    if not os.path.exists(BASELINE):
+        print(f"{BASELINE} not found, run with --update first")
+        return 1
+    with open(BASELINE) as fp:
+        baseline = json.load(fp)
+
+    failures = compare(baseline, current, args)
+    if failures:
+        print(f"{len(failures)} regression(s)")
+        return 1
+    print("no regressions")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())